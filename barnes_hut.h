@@ -0,0 +1,409 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include "common.h"
+#include "nbody.h"
+
+// Barnes-Hut net Coulomb force. Particles are sorted along a Morton curve so every quadtree cell
+// is a contiguous particle range. Each cell keeps the positive and negative charge as two separate
+// monopoles, since a signed total can cancel to zero. A cell whose side is below theta times its
+// distance to the target is taken as those two monopoles; otherwise it is opened.
+constexpr int kBarnesHutLeafSize = 16;
+// Subtrees are rooted this many levels below the root (up to 4^4 cells); they are the units
+// that get built in parallel and handed out to ranks.
+constexpr int kBarnesHutSplitLevel = 4;
+
+struct bh_node {
+    double pos_charge;
+    double pos_x;
+    double pos_y;
+    double neg_charge;
+    double neg_x;
+    double neg_y;
+    double center_x;
+    double center_y;
+    double size;
+    int begin;
+    int end;
+    int child[4];
+    int level;
+};
+
+// Particles in Morton order; index maps back to the original position.
+struct bh_particles {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> q;
+    std::vector<int> index;
+    std::vector<uint64_t> code;
+    int32_t min_x = 0;
+    int32_t min_y = 0;
+    int side_bits = 0;
+
+    size_t size() const { return x.size(); }
+};
+
+struct bh_tree {
+    std::vector<bh_node> nodes;
+    int root = -1;
+};
+
+inline uint64_t spread_bits(uint64_t v) {
+    v &= 0xffffffffULL;
+    v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+    v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
+
+inline uint64_t morton_code(uint32_t x, uint32_t y) {
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+inline uint32_t compact_bits(uint64_t v) {
+    v &= 0x5555555555555555ULL;
+    v = (v | (v >> 1)) & 0x3333333333333333ULL;
+    v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v >> 4)) & 0x00ff00ff00ff00ffULL;
+    v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+    v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+    return static_cast<uint32_t>(v);
+}
+
+// Sorts (code, index) pairs: each thread sorts a chunk, then chunks are merged pairwise in parallel.
+inline void parallel_sort(std::vector<std::pair<uint64_t, int>>& keys, int num_threads) {
+    const int n = keys.size();
+    num_threads = std::max(1, std::min(num_threads, n / 4096 + 1));
+    std::vector<int> bounds(num_threads + 1);
+    for (int t = 0; t <= num_threads; t ++) {
+        bounds[t] = static_cast<int>(static_cast<int64_t>(n) * t / num_threads);
+    }
+    parallel_ranges(num_threads, num_threads, [&](int start, int end) {
+        for (int t = start; t < end; t ++) {
+            std::sort(keys.begin() + bounds[t], keys.begin() + bounds[t + 1]);
+        }
+    });
+    for (int width = 1; width < num_threads; width *= 2) {
+        const int merges = (num_threads + 2 * width - 1) / (2 * width);
+        parallel_ranges(merges, merges, [&](int start, int end) {
+            for (int m = start; m < end; m ++) {
+                int lo = m * 2 * width;
+                int mid = std::min(lo + width, num_threads);
+                int hi = std::min(lo + 2 * width, num_threads);
+                std::inplace_merge(keys.begin() + bounds[lo], keys.begin() + bounds[mid], keys.begin() + bounds[hi]);
+            }
+        });
+    }
+}
+
+inline bh_particles morton_sort(const particle_columns& charges, int num_threads) {
+    const int n = charges.count;
+    bh_particles p;
+    if (n == 0) {
+        return p;
+    }
+    p.min_x = *std::min_element(charges.x, charges.x + n);
+    p.min_y = *std::min_element(charges.y, charges.y + n);
+    uint32_t extent = 0;
+    for (int i = 0; i < n; i ++) {
+        extent = std::max(extent, static_cast<uint32_t>(static_cast<int64_t>(charges.x[i]) - p.min_x));
+        extent = std::max(extent, static_cast<uint32_t>(static_cast<int64_t>(charges.y[i]) - p.min_y));
+    }
+    while (p.side_bits < 32 && (static_cast<uint64_t>(1) << p.side_bits) <= extent) {
+        p.side_bits ++;
+    }
+
+    std::vector<std::pair<uint64_t, int>> keys(n);
+    parallel_ranges(n, num_threads, [&](int start, int end) {
+        for (int i = start; i < end; i ++) {
+            uint32_t ux = static_cast<uint32_t>(static_cast<int64_t>(charges.x[i]) - p.min_x);
+            uint32_t uy = static_cast<uint32_t>(static_cast<int64_t>(charges.y[i]) - p.min_y);
+            keys[i] = std::make_pair(morton_code(ux, uy), i);
+        }
+    });
+    parallel_sort(keys, num_threads);
+
+    p.x.resize(n);
+    p.y.resize(n);
+    p.q.resize(n);
+    p.index.resize(n);
+    p.code.resize(n);
+    parallel_ranges(n, num_threads, [&](int start, int end) {
+        for (int k = start; k < end; k ++) {
+            int i = keys[k].second;
+            p.code[k] = keys[k].first;
+            p.index[k] = i;
+            p.x[k] = charges.x[i];
+            p.y[k] = charges.y[i];
+            p.q[k] = charges.polarity ? charges.polarity[i] : 1;
+        }
+    });
+    return p;
+}
+
+// Morton prefix of the level-l cell holding sorted particle k.
+inline uint64_t cell_key(const bh_particles& p, int k, int level) {
+    int shift = 2 * (p.side_bits - level);
+    return shift >= 64 ? 0 : p.code[k] >> shift;
+}
+
+inline void set_cell_geometry(const bh_particles& p, uint64_t key, int level, bh_node& node) {
+    double side = std::ldexp(1.0, p.side_bits - level);
+    node.size = side;
+    node.center_x = p.min_x + compact_bits(key) * side + side / 2;
+    node.center_y = p.min_y + compact_bits(key >> 1) * side + side / 2;
+    node.level = level;
+}
+
+inline void finish_aggregates(bh_node& node) {
+    if (node.pos_charge > 0) {
+        node.pos_x /= node.pos_charge;
+        node.pos_y /= node.pos_charge;
+    }
+    if (node.neg_charge > 0) {
+        node.neg_x /= node.neg_charge;
+        node.neg_y /= node.neg_charge;
+    }
+}
+
+// Adds child's monopoles into parent, whose sums are still charge-weighted (not yet finished).
+inline void add_child_aggregates(bh_node& parent, const bh_node& child) {
+    parent.pos_charge += child.pos_charge;
+    parent.pos_x += child.pos_x * child.pos_charge;
+    parent.pos_y += child.pos_y * child.pos_charge;
+    parent.neg_charge += child.neg_charge;
+    parent.neg_x += child.neg_x * child.neg_charge;
+    parent.neg_y += child.neg_y * child.neg_charge;
+}
+
+// Builds the cell holding sorted particles [begin, end) at level into nodes (indices local to it).
+inline int build_subtree(const bh_particles& p, int begin, int end, int level, std::vector<bh_node>& nodes) {
+    bh_node node = {};
+    node.begin = begin;
+    node.end = end;
+    std::fill(node.child, node.child + 4, -1);
+    set_cell_geometry(p, cell_key(p, begin, level), level, node);
+    const int idx = nodes.size();
+    nodes.push_back(node);
+
+    if (end - begin <= kBarnesHutLeafSize || level == p.side_bits) {
+        for (int k = begin; k < end; k ++) {
+            if (p.q[k] > 0) {
+                node.pos_charge += p.q[k];
+                node.pos_x += p.x[k] * p.q[k];
+                node.pos_y += p.y[k] * p.q[k];
+            } else {
+                node.neg_charge -= p.q[k];
+                node.neg_x -= p.x[k] * p.q[k];
+                node.neg_y -= p.y[k] * p.q[k];
+            }
+        }
+    } else {
+        int start = begin;
+        for (int quadrant = 0; quadrant < 4 && start < end; quadrant ++) {
+            uint64_t key = (cell_key(p, begin, level) << 2) | quadrant;
+            int stop = std::partition_point(p.code.begin() + start, p.code.begin() + end, [&](uint64_t code) {
+                return (code >> (2 * (p.side_bits - level - 1))) <= key;
+            }) - p.code.begin();
+            if (stop > start) {
+                int child = build_subtree(p, start, stop, level + 1, nodes);
+                node.child[quadrant] = child;
+                add_child_aggregates(node, nodes[child]);
+            }
+            start = stop;
+        }
+    }
+    finish_aggregates(node);
+    nodes[idx] = node;
+    return idx;
+}
+
+// Particle ranges of the non-empty cells at the split level, in Morton order.
+inline std::vector<std::pair<int, int>> subtree_ranges(const bh_particles& p, int split_level) {
+    std::vector<std::pair<int, int>> ranges;
+    const int n = p.size();
+    for (int begin = 0; begin < n; ) {
+        uint64_t key = cell_key(p, begin, split_level);
+        int end = std::partition_point(p.code.begin() + begin, p.code.end(), [&](uint64_t code) {
+            int shift = 2 * (p.side_bits - split_level);
+            return (shift >= 64 ? 0 : code >> shift) == key;
+        }) - p.code.begin();
+        ranges.push_back(std::make_pair(begin, end));
+        begin = end;
+    }
+    return ranges;
+}
+
+inline int split_level_for(const bh_particles& p) {
+    return std::min(kBarnesHutSplitLevel, p.side_bits);
+}
+
+// Appends local subtree nodes to the tree, shifting their child links.
+inline void append_subtree(bh_tree& tree, const std::vector<bh_node>& local) {
+    const int offset = tree.nodes.size();
+    for (bh_node node : local) {
+        for (int c = 0; c < 4; c ++) {
+            if (node.child[c] >= 0) node.child[c] += offset;
+        }
+        tree.nodes.push_back(node);
+    }
+}
+
+// Joins subtree roots (nodes at split_level, in Morton order) into the levels above them.
+inline void assemble_top_levels(const bh_particles& p, int split_level, bh_tree& tree) {
+    std::vector<int> current;
+    for (int i = 0; i < tree.nodes.size(); i ++) {
+        if (tree.nodes[i].level == split_level) current.push_back(i);
+    }
+    std::sort(current.begin(), current.end(), [&](int a, int b) { return tree.nodes[a].begin < tree.nodes[b].begin; });
+    for (int level = split_level - 1; level >= 0; level --) {
+        std::vector<int> parents;
+        for (size_t i = 0; i < current.size(); ) {
+            const bh_node& first = tree.nodes[current[i]];
+            uint64_t key = cell_key(p, first.begin, level);
+            bh_node parent = {};
+            std::fill(parent.child, parent.child + 4, -1);
+            set_cell_geometry(p, key, level, parent);
+            parent.begin = first.begin;
+            for (; i < current.size() && cell_key(p, tree.nodes[current[i]].begin, level) == key; i ++) {
+                const bh_node& child = tree.nodes[current[i]];
+                parent.child[cell_key(p, child.begin, level + 1) & 3] = current[i];
+                parent.end = child.end;
+                add_child_aggregates(parent, child);
+            }
+            finish_aggregates(parent);
+            parents.push_back(tree.nodes.size());
+            tree.nodes.push_back(parent);
+        }
+        current.swap(parents);
+    }
+    tree.root = current.empty() ? -1 : current[0];
+}
+
+inline bh_tree build_barnes_hut_tree(const bh_particles& p, int num_threads) {
+    bh_tree tree;
+    const int split_level = split_level_for(p);
+    std::vector<std::pair<int, int>> ranges = subtree_ranges(p, split_level);
+    std::vector<std::vector<bh_node>> subtrees(ranges.size());
+    std::atomic<int> next(0);
+    parallel_ranges(num_threads, num_threads, [&](int, int) {
+        for (int s = next.fetch_add(1); s < ranges.size(); s = next.fetch_add(1)) {
+            build_subtree(p, ranges[s].first, ranges[s].second, split_level, subtrees[s]);
+        }
+    });
+    for (const auto & subtree : subtrees) {
+        append_subtree(tree, subtree);
+    }
+    assemble_top_levels(p, split_level, tree);
+    return tree;
+}
+
+inline void add_monopole(double charge, double cx, double cy, double px, double py, double& fx, double& fy) {
+    if (charge == 0) return;
+    double dx = px - cx;
+    double dy = py - cy;
+    double r2 = dx * dx + dy * dy;
+    if (r2 <= 0) return;
+    double inv_r = 1.0 / std::sqrt(r2);
+    double s = charge * inv_r * inv_r * inv_r;
+    fx += s * dx;
+    fy += s * dy;
+}
+
+// Unscaled field at sorted particle k: sum over sources of q_j * d / |d|^3.
+inline void barnes_hut_field(const bh_tree& tree, const bh_particles& p, int k, double theta, double& fx, double& fy) {
+    fx = 0;
+    fy = 0;
+    if (tree.root < 0) return;
+    const double px = p.x[k];
+    const double py = p.y[k];
+    int stack[4 * 64 + 4];
+    int top = 0;
+    stack[top ++] = tree.root;
+    while (top > 0) {
+        const bh_node& node = tree.nodes[stack[-- top]];
+        double cx = px - node.center_x;
+        double cy = py - node.center_y;
+        double d2 = cx * cx + cy * cy;
+        bool leaf = node.child[0] < 0 && node.child[1] < 0 && node.child[2] < 0 && node.child[3] < 0;
+        if (node.size * node.size < theta * theta * d2) {
+            add_monopole(node.pos_charge, node.pos_x, node.pos_y, px, py, fx, fy);
+            add_monopole(-node.neg_charge, node.neg_x, node.neg_y, px, py, fx, fy);
+        } else if (leaf) {
+            for (int j = node.begin; j < node.end; j ++) {
+                add_monopole(p.q[j], p.x[j], p.y[j], px, py, fx, fy);
+            }
+        } else {
+            for (int c = 0; c < 4; c ++) {
+                if (node.child[c] >= 0) stack[top ++] = node.child[c];
+            }
+        }
+    }
+}
+
+// Forces on sorted particles [begin, end), scaled to newtons, written to fx/fy[k - begin].
+inline void barnes_hut_range(const bh_tree& tree, const bh_particles& p, double theta, int begin, int end, int num_threads, double* fx, double* fy) {
+    parallel_ranges(end - begin, num_threads, [&](int start, int stop) {
+        for (int k = begin + start; k < begin + stop; k ++) {
+            double field_x, field_y;
+            barnes_hut_field(tree, p, k, theta, field_x, field_y);
+            fx[k - begin] = field_x * p.q[k] * kNetForceScale;
+            fy[k - begin] = field_y * p.q[k] * kNetForceScale;
+        }
+    });
+}
+
+inline net_forces barnes_hut_calculation(const particle_columns& charges, double theta, int num_threads=4) {
+    bh_particles p = morton_sort(charges, num_threads);
+    bh_tree tree = build_barnes_hut_tree(p, num_threads);
+    const int n = p.size();
+    std::vector<double> sorted_fx(n), sorted_fy(n);
+    barnes_hut_range(tree, p, theta, 0, n, num_threads, sorted_fx.data(), sorted_fy.data());
+
+    net_forces forces;
+    forces.fx.resize(n);
+    forces.fy.resize(n);
+    for (int k = 0; k < n; k ++) {
+        forces.fx[p.index[k]] = sorted_fx[k];
+        forces.fy[p.index[k]] = sorted_fy[k];
+    }
+    return forces;
+}
+
+// Compares forces against the exact all-pairs sum on evenly spaced sample particles.
+inline approximation_error sample_force_error(const particle_columns& charges, const net_forces& forces, int samples, int num_threads=4) {
+    approximation_error error;
+    const int n = charges.count;
+    samples = std::min(samples, n);
+    if (samples <= 0) {
+        return error;
+    }
+    nbody_particles all(charges, 0, n);
+    nbody_block sources = make_nbody_block(all, 0, n);
+    std::vector<double> relative(samples);
+    parallel_ranges(samples, num_threads, [&](int start, int end) {
+        for (int s = start; s < end; s ++) {
+            int i = static_cast<int>(static_cast<int64_t>(s) * n / samples);
+            nbody_block target = make_nbody_block(all, i, i + 1);
+            double fx = 0, fy = 0;
+            nbody_tile_scalar(target, sources, false, &fx, &fy, nullptr, nullptr);
+            fx *= kNetForceScale;
+            fy *= kNetForceScale;
+            double exact = std::sqrt(fx * fx + fy * fy);
+            double diff = std::hypot(forces.fx[i] - fx, forces.fy[i] - fy);
+            relative[s] = exact > 0 ? diff / exact : diff;
+        }
+    });
+    double sum_sq = 0;
+    for (double r : relative) {
+        error.max_relative = std::max(error.max_relative, r);
+        sum_sq += r * r;
+    }
+    error.samples = samples;
+    error.rms_relative = std::sqrt(sum_sq / samples);
+    return error;
+}
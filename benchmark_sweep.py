@@ -0,0 +1,203 @@
+"""Sweeps ForceCalculation / ForceCalculationMPI over modes, particle counts, threads and ranks.
+
+Every configuration gets warmup runs that are thrown away, then repeated runs whose
+"Time to ..." lines are collected per phase and reduced to median and p95. The script
+prints strong scaling tables (fixed particle count, more threads or ranks) and weak
+scaling tables (fixed particles per thread or rank) and writes everything as JSON.
+Given a baseline JSON from an earlier build, it exits with status 1 when a median got
+slower than the tolerance allows.
+
+    python3 benchmark_sweep.py --modes 1,2,3,4,mpi --sizes 1000,100000,10000000 --weak 1000000 \\
+        --threads 1,2,4,8 --ranks 1,2,4 --repetitions 5 --output sweep.json
+    python3 benchmark_sweep.py ... --baseline sweep.json --tolerance 0.1
+"""
+import argparse
+import json
+import math
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+TIME_LINE = re.compile(r'^Time to (.+?)(?: for mode=\d+)?(?::| took) ([-+\d.eE]+) microseconds')
+CHUNKS = re.compile(r' in \d+ chunks$')
+
+
+def parse_times(output):
+    times = {}
+    for line in output.splitlines():
+        match = TIME_LINE.match(line.strip())
+        if match:
+            phase = CHUNKS.sub('', match.group(1))
+            times[phase] = times.get(phase, 0.0) + float(match.group(2))
+    if times:
+        times['total'] = sum(value for phase, value in times.items() if phase != 'run tests')
+    return times
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(fraction * len(ordered)) - 1)]
+
+
+def command_for(args, mode, size, threads, ranks):
+    if mode == 'mpi':
+        command = ['mpirun', '-np', str(ranks)] + args.mpirun_args.split() + [
+            os.path.join(args.build, 'ForceCalculationMPI'), str(threads), str(size)]
+    else:
+        command = [os.path.join(args.build, 'ForceCalculation'), f'mode={mode}', f'num_particles={size}']
+        if mode != '1':
+            command.append(f'num_threads={threads}')
+        command.append('skip_tests=1')
+    return command + args.extra.split()
+
+
+def run_configuration(args, mode, size, threads, ranks):
+    command = command_for(args, mode, size, threads, ranks)
+    samples = []
+    for run in range(args.warmup + args.repetitions):
+        started = time.perf_counter()
+        result = subprocess.run(command, capture_output=True, text=True)
+        wall = (time.perf_counter() - started) * 1E6
+        if result.returncode != 0:
+            print(f"failed: {' '.join(command)}\n{result.stderr}", file=sys.stderr)
+            return None
+        if run >= args.warmup:
+            times = parse_times(result.stdout)
+            times['wall'] = wall
+            samples.append(times)
+
+    phases = {}
+    for phase in samples[0]:
+        values = [sample[phase] for sample in samples if phase in sample]
+        phases[phase] = {'median': statistics.median(values), 'p95': percentile(values, 0.95),
+                         'min': min(values), 'max': max(values), 'samples': values}
+    return {'mode': mode, 'size': size, 'threads': threads, 'ranks': ranks,
+            'command': ' '.join(command), 'phases': phases}
+
+
+def key_of(result):
+    return (result['mode'], result['size'], result['threads'], result['ranks'])
+
+
+def workers(result):
+    return result['threads'] * result['ranks']
+
+
+def scaling_tables(results, metric, weak_sizes=()):
+    """Strong: same size, speedup against the fewest workers. Weak: the runs sized for one of
+    weak_sizes particles per worker, only where the fewest-worker configuration ran too."""
+    strong, weak = [], []
+    by_mode = {}
+    for result in results:
+        by_mode.setdefault(result['mode'], []).append(result)
+    for mode, mode_results in sorted(by_mode.items()):
+        for size in sorted({r['size'] for r in mode_results}):
+            rows = sorted((r for r in mode_results if r['size'] == size), key=workers)
+            base = rows[0]
+            for row in rows:
+                speedup = base['phases'][metric]['median'] / row['phases'][metric]['median']
+                strong.append({'mode': mode, 'size': size, 'threads': row['threads'], 'ranks': row['ranks'],
+                               'median_us': row['phases'][metric]['median'], 'speedup': speedup,
+                               'efficiency': speedup * workers(base) / workers(row)})
+        fewest = min(workers(r) for r in mode_results)
+        for size_per_worker in sorted(set(weak_sizes)):
+            rows = sorted((r for r in mode_results if r['size'] == size_per_worker * workers(r)), key=workers)
+            if len(rows) < 2 or workers(rows[0]) != fewest:
+                continue
+            base = rows[0]
+            for row in rows:
+                weak.append({'mode': mode, 'size_per_worker': size_per_worker, 'threads': row['threads'],
+                             'ranks': row['ranks'], 'median_us': row['phases'][metric]['median'],
+                             'efficiency': base['phases'][metric]['median'] / row['phases'][metric]['median']})
+    return strong, weak
+
+
+def print_table(title, rows, columns):
+    if not rows:
+        return
+    print(f'\n{title}')
+    print('  '.join(f'{column:>14}' for column in columns))
+    for row in rows:
+        print('  '.join(f'{row[column]:>14.4g}' if isinstance(row[column], float) else f'{row[column]:>14}' for column in columns))
+
+
+def compare_to_baseline(results, baseline_file, metric, tolerance):
+    with open(baseline_file) as f:
+        baseline = {key_of(r): r for r in json.load(f)['results']}
+    regressions = []
+    for result in results:
+        old = baseline.get(key_of(result))
+        if old is None or metric not in old['phases']:
+            continue
+        before = old['phases'][metric]['median']
+        after = result['phases'][metric]['median']
+        if after > before * (1 + tolerance):
+            regressions.append((key_of(result), before, after))
+    for (mode, size, threads, ranks), before, after in regressions:
+        print(f'REGRESSION mode={mode} size={size} threads={threads} ranks={ranks}: '
+              f'{before:.1f} -> {after:.1f} microseconds (+{(after / before - 1) * 100:.1f}%)')
+    return regressions
+
+
+def parse_list(text):
+    return [item for item in text.split(',') if item]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--build', default='./build', help='directory holding the binaries')
+    parser.add_argument('--modes', default='1,2', help='ForceCalculation modes and/or "mpi"')
+    parser.add_argument('--sizes', default='1000,10000,100000,1000000')
+    parser.add_argument('--threads', default='1,2,4')
+    parser.add_argument('--ranks', default='1,2', help='rank counts for the mpi mode')
+    parser.add_argument('--weak', default='', help='particles per thread and rank; adds runs sized for weak scaling')
+    parser.add_argument('--warmup', type=int, default=1)
+    parser.add_argument('--repetitions', type=int, default=5)
+    parser.add_argument('--metric', default='total', help='phase used for scaling and regressions, or "wall"')
+    parser.add_argument('--extra', default='', help='extra key=value arguments for every run')
+    parser.add_argument('--mpirun-args', default='', help='extra mpirun arguments, e.g. "--oversubscribe"')
+    parser.add_argument('--output', default='benchmark_sweep.json')
+    parser.add_argument('--baseline', help='earlier --output to check for regressions')
+    parser.add_argument('--tolerance', type=float, default=0.1)
+    args = parser.parse_args()
+
+    results = []
+    for mode in parse_list(args.modes):
+        thread_counts = ['1'] if mode == '1' else parse_list(args.threads)
+        rank_counts = parse_list(args.ranks) if mode == 'mpi' else ['1']
+        for threads in map(int, thread_counts):
+            for ranks in map(int, rank_counts):
+                sizes = sorted(set(map(int, parse_list(args.sizes))) | {int(per) * threads * ranks for per in parse_list(args.weak)})
+                for size in sizes:
+                    result = run_configuration(args, mode, size, threads, ranks)
+                    if result is None:
+                        continue
+                    results.append(result)
+                    phases = result['phases']
+                    print(f"mode={mode} size={size} threads={threads} ranks={ranks}: "
+                          + ', '.join(f"{phase} median={value['median']:.1f} p95={value['p95']:.1f}" for phase, value in phases.items()))
+
+    strong, weak = scaling_tables([r for r in results if args.metric in r['phases']], args.metric,
+                                  [int(per) for per in parse_list(args.weak)])
+    print_table('Strong scaling', strong, ['mode', 'size', 'threads', 'ranks', 'median_us', 'speedup', 'efficiency'])
+    print_table('Weak scaling', weak, ['mode', 'size_per_worker', 'threads', 'ranks', 'median_us', 'efficiency'])
+
+    git = subprocess.run(['git', 'rev-parse', 'HEAD'], capture_output=True, text=True)
+    report = {'machine': {'node': platform.node(), 'processor': platform.processor(), 'cpus': os.cpu_count()},
+              'commit': git.stdout.strip() if git.returncode == 0 else None,
+              'settings': {'warmup': args.warmup, 'repetitions': args.repetitions, 'metric': args.metric, 'extra': args.extra},
+              'results': results, 'strong_scaling': strong, 'weak_scaling': weak}
+    with open(args.output, 'w') as f:
+        json.dump(report, f, indent=2)
+    print(f'\nwrote {args.output}')
+
+    if args.baseline and compare_to_baseline(results, args.baseline, args.metric, args.tolerance):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+// Google Benchmark suite for the single-process pipeline: ingestion, neighbor setup and every force
+// mode over particle counts from 1k up to max_particles and 1 to max_threads pool threads. Built as
+// ForceBenchmarks when CMake finds the benchmark package; run it from the directory that holds
+// particles-student-1.csv, e.g.
+//
+//   ./build/ForceBenchmarks max_particles=1000000 max_threads=8 --benchmark_repetitions=10 --benchmark_format=json --benchmark_out=bench.json
+//
+// Every benchmark warms up first and reports median, p95 and the other aggregates per repetition
+// set. benchmark_sweep.py covers the MPI binary and the end-to-end runs.
+#define main force_main
+#include "main.cpp"
+#undef main
+#include <map>
+#include <benchmark/benchmark.h>
+
+static const char* kInputFile = "./particles-student-1.csv";
+
+static double p95(const std::vector<double>& v) {
+    if (v.empty()) {
+        return 0;
+    }
+    std::vector<double> sorted(v);
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(std::ceil(0.95 * sorted.size())) - 1)];
+}
+
+// Parsed and neighbor-assigned particles, loaded once per size and shared by all benchmarks.
+static const particle_store& particles(int num_particles) {
+    static std::map<int, particle_store> cache;
+    auto it = cache.find(num_particles);
+    if (it == cache.end()) {
+        it = cache.emplace(num_particles, particle_store(setup_point_charges(kInputFile, num_particles, std::thread::hardware_concurrency(), neighbor_mode::grid))).first;
+    }
+    return it->second;
+}
+
+// The pool is sized outside the timed region and only rebuilt when the thread count changes.
+static void use_threads(int num_threads) {
+    static int current = 0;
+    if (current != num_threads) {
+        thread_pool::configure(num_threads);
+        current = num_threads;
+    }
+}
+
+static void BM_ReadPointCharges(benchmark::State& state) {
+    const int n = state.range(0);
+    const int threads = state.range(1);
+    use_threads(threads);
+    size_t parsed = 0;
+    for (auto _ : state) {
+        std::vector<point_charge> charges = read_point_charges(kInputFile, n, threads);
+        benchmark::DoNotOptimize(charges.data());
+        parsed = charges.size();
+    }
+    // sizes past the end of the file only parse what is there
+    state.SetItemsProcessed(state.iterations() * parsed);
+}
+
+static void BM_AdjacentNeighbors(benchmark::State& state) {
+    std::vector<point_charge> charges = read_point_charges(kInputFile, state.range(0));
+    for (auto _ : state) {
+        assign_adjacent_neighbors(charges);
+        benchmark::DoNotOptimize(charges.data());
+    }
+    state.SetItemsProcessed(state.iterations() * charges.size());
+}
+
+static void BM_GridNeighbors(benchmark::State& state) {
+    const int threads = state.range(1);
+    use_threads(threads);
+    std::vector<point_charge> charges = read_point_charges(kInputFile, state.range(0));
+    for (auto _ : state) {
+        assign_grid_neighbors(charges, threads);
+        benchmark::DoNotOptimize(charges.data());
+    }
+    state.SetItemsProcessed(state.iterations() * charges.size());
+}
+
+static void BM_SerialCalculation(benchmark::State& state) {
+    const particle_columns columns = particles(state.range(0)).columns();
+    for (auto _ : state) {
+        std::vector<double> ans = serial_calculation(columns);
+        benchmark::DoNotOptimize(ans.data());
+    }
+    state.SetItemsProcessed(state.iterations() * columns.count);
+}
+
+static void BM_SerialCalculationFloat(benchmark::State& state) {
+    const particle_columns columns = particles(state.range(0)).columns();
+    const basic_nearest_force_kernel<float> kernel = select_nearest_force_kernel<float>();
+    for (auto _ : state) {
+        std::vector<float> ans = serial_calculation(columns, kernel);
+        benchmark::DoNotOptimize(ans.data());
+    }
+    state.SetItemsProcessed(state.iterations() * columns.count);
+}
+
+static void BM_MultithreadCalculation(benchmark::State& state) {
+    const int threads = state.range(1);
+    use_threads(threads);
+    const particle_columns columns = particles(state.range(0)).columns();
+    for (auto _ : state) {
+        std::vector<double> ans = multithread_calculation(columns, threads);
+        benchmark::DoNotOptimize(ans.data());
+    }
+    state.SetItemsProcessed(state.iterations() * columns.count);
+}
+
+static void BM_AllPairs(benchmark::State& state) {
+    const int threads = state.range(1);
+    use_threads(threads);
+    const particle_columns columns = particles(state.range(0)).columns();
+    for (auto _ : state) {
+        net_forces forces = all_pairs_calculation(columns, threads);
+        benchmark::DoNotOptimize(forces.fx.data());
+    }
+    state.SetItemsProcessed(state.iterations() * columns.count * (columns.count - 1));
+}
+
+static void BM_BarnesHut(benchmark::State& state) {
+    const int threads = state.range(1);
+    use_threads(threads);
+    const particle_columns columns = particles(state.range(0)).columns();
+    for (auto _ : state) {
+        net_forces forces = barnes_hut_calculation(columns, 0.5, threads);
+        benchmark::DoNotOptimize(forces.fx.data());
+    }
+    state.SetItemsProcessed(state.iterations() * columns.count);
+}
+
+static void BM_SimulationStep(benchmark::State& state) {
+    const int threads = state.range(1);
+    use_threads(threads);
+    particle_state initial = make_particle_state(particles(state.range(0)).columns());
+    simulation_config config;
+    config.steps = 10;
+    for (auto _ : state) {
+        state.PauseTiming();
+        particle_state moving = initial;
+        state.ResumeTiming();
+        run_simulation(moving, config, threads);
+    }
+    state.SetItemsProcessed(state.iterations() * config.steps * initial.size());
+}
+
+// Sizes 1k, 10k, ... up to limit; thread counts 1, 2, 4, ... up to max_threads.
+static void register_sweep(const char* name, void (*fn)(benchmark::State&), int limit, int max_threads, bool threaded) {
+    for (int64_t n = 1000; n <= limit; n *= 10) {
+        for (int t = 1; t <= (threaded ? max_threads : 1); t *= 2) {
+            benchmark::RegisterBenchmark(name, fn)
+                ->Args({n, t})
+                ->ArgNames({"n", "threads"})
+                ->Unit(benchmark::kMicrosecond)
+                ->UseRealTime()
+                ->MinWarmUpTime(0.2)
+                ->ComputeStatistics("p95", p95);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    const int max_particles = std::stoi(find_arg(argc, argv, "max_particles", "1000000"));
+    const int max_threads = std::stoi(find_arg(argc, argv, "max_threads", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+    // all-pairs is quadratic, so it stops at 100k
+    const int max_all_pairs = std::min(max_particles, std::stoi(find_arg(argc, argv, "max_all_pairs", "100000")));
+
+    register_sweep("ReadPointCharges", BM_ReadPointCharges, max_particles, max_threads, true);
+    register_sweep("AdjacentNeighbors", BM_AdjacentNeighbors, max_particles, max_threads, false);
+    register_sweep("GridNeighbors", BM_GridNeighbors, max_particles, max_threads, true);
+    register_sweep("SerialCalculation", BM_SerialCalculation, max_particles, max_threads, false);
+    register_sweep("SerialCalculationFloat", BM_SerialCalculationFloat, max_particles, max_threads, false);
+    register_sweep("MultithreadCalculation", BM_MultithreadCalculation, max_particles, max_threads, true);
+    register_sweep("AllPairs", BM_AllPairs, max_all_pairs, max_threads, true);
+    register_sweep("BarnesHut", BM_BarnesHut, max_particles, max_threads, true);
+    register_sweep("SimulationStep", BM_SimulationStep, max_particles, max_threads, true);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,9 +1,21 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <cassert>
 #include <cmath>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <initializer_list>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "neighbor_search.h"
+#include "trace.h"
 
 constexpr double kq1q2 = 8.99e9 * 1.6e-19 * 1.6e-19;
 
@@ -12,44 +24,136 @@ struct point_charge {
     int x;
     int y;
     int nearest_neighbor_idx;
+    int polarity;
 };
 
+// Read-only column view over particles stored structure-of-arrays, e.g. a mapped snapshot.
+template <typename Coord>
+struct basic_particle_columns {
+    size_t count = 0;
+    const Coord* x = nullptr;
+    const Coord* y = nullptr;
+    const int8_t* polarity = nullptr;
+    const int32_t* nearest_neighbor_idx = nullptr;
+};
+
+typedef basic_particle_columns<int32_t> particle_columns;
+
+// How far approximate forces (Barnes-Hut, single precision) are from the exact ones over samples particles.
+struct approximation_error {
+    int samples = 0;
+    double max_relative = 0;
+    double rms_relative = 0;
+};
+
+// Squared distances in input units (1e-10 m); the force laws fold the unit into their constants.
 inline double distance_between_square(const point_charge & p1, const point_charge & p2) {
-    return (pow(p1.x - p2.x, 2) + pow(p1.y - p2.y, 2)) * 1e-20;
+    double dx = p1.x - p2.x;
+    double dy = p1.y - p2.y;
+    return dx * dx + dy * dy;
+}
+
+template <typename Coord>
+inline double distance_between_square(const basic_particle_columns<Coord> & c, int i, int j) {
+    double dx = c.x[i] - c.x[j];
+    double dy = c.y[i] - c.y[j];
+    return dx * dx + dy * dy;
 }
 
-void print_force(const std::vector<double> forces) {
-    for (int i = 0; i < forces.size(); i ++) {
-        std::cout << "ID: " << i + 1 << ", Force=" << forces[i] << std::endl;
+// Parses one "x,y,polarity" record starting at p, returns the start of the next line.
+// Coordinates are plain decimal integers with an optional leading '-'; a polarity of
+// '-', 'e' or 'n' is negative, anything else positive.
+inline const char* parse_point_charge_line(const char* p, const char* end, point_charge& charge) {
+    int values[2] = {0, 0};
+    for (int field = 0; field < 2 && p < end && *p != '\n'; field ++) {
+        while (p < end && (*p == ' ' || *p == '\t')) p ++;
+        bool negative = false;
+        if (p < end && *p == '-') {
+            negative = true;
+            p ++;
+        }
+        int value = 0;
+        while (p < end && static_cast<unsigned>(*p - '0') < 10) {
+            value = value * 10 + (*p - '0');
+            p ++;
+        }
+        values[field] = negative ? -value : value;
+        while (p < end && *p != ',' && *p != '\n') p ++;
+        if (p < end && *p == ',') p ++;
     }
+    charge.x = values[0];
+    charge.y = values[1];
+    while (p < end && *p == ' ') p ++;
+    char polarity = p < end ? *p : '+';
+    charge.polarity = (polarity == '-' || polarity == 'e' || polarity == 'E' || polarity == 'n' || polarity == 'N') ? -1 : 1;
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    return eol ? eol + 1 : end;
 }
 
-std::vector<point_charge> setup_point_charges(const std::string& filename, int max_line=1000) {
-    std::vector<point_charge> charges;
-    std::ifstream file(filename);
-    if (!file) {
-        return charges;
+// Returns the start of the line following the first '\n' at or after p.
+inline const char* next_line_start(const char* p, const char* end) {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    return eol ? eol + 1 : end;
+}
+
+inline int count_lines(const char* begin, const char* end, int limit) {
+    int count = 0;
+    const char* p = begin;
+    while (p < end && count < limit) {
+        p = next_line_start(p, end);
+        count ++;
     }
+    return count;
+}
+
+// Parses up to max_line records out of an in-memory "x,y,polarity" buffer into charges.
+// With num_threads > 1 the buffer is cut into newline-aligned chunks, every chunk counts
+// its lines, and after a prefix sum each thread parses straight into its slice of the output.
+inline void parse_point_charges(const char* begin, const char* end, int max_line, int num_threads, std::vector<point_charge>& charges) {
+    if (num_threads < 1) num_threads = 1;
+    // not worth a thread below ~1MB per chunk
+    size_t bytes = end - begin;
+    num_threads = std::max(1, std::min<int>(num_threads, bytes / (1 << 20)));
 
-    std::string line;
-    int line_count = 0;
-    while (getline(file, line) && line_count < max_line) {
-        std::stringstream ss(line);
-        point_charge charge;
-        char comma, polarity;
-        charge.idx = line_count;
-        ss >> charge.x >> comma >> charge.y >> comma >> polarity;
-        charges.push_back(charge);
-        line_count ++;
+    std::vector<const char*> bounds(num_threads + 1);
+    bounds[0] = begin;
+    bounds[num_threads] = end;
+    for (int i = 1; i < num_threads; i ++) {
+        const char* guess = begin + bytes / num_threads * i;
+        bounds[i] = std::max(bounds[i - 1], guess > begin ? next_line_start(guess - 1, end) : begin);
     }
 
-    file.close();
-    
-    if (charges.size() < 2) {
-        std::cerr << "too few points!" << std::endl;
-        return charges;
+    std::vector<int> counts(num_threads);
+    parallel_ranges(num_threads, num_threads, [&](int start, int stop) {
+        for (int i = start; i < stop; i ++) counts[i] = count_lines(bounds[i], bounds[i + 1], max_line);
+    });
+
+    std::vector<int> offsets(num_threads + 1, 0);
+    for (int i = 0; i < num_threads; i ++) {
+        offsets[i + 1] = std::min(max_line, offsets[i] + counts[i]);
     }
+    charges.resize(offsets[num_threads]);
+
+    parallel_ranges(num_threads, num_threads, [&](int start, int stop) {
+        for (int i = start; i < stop; i ++) {
+            const char* p = bounds[i];
+            for (int j = offsets[i]; j < offsets[i + 1]; j ++) {
+                charges[j].idx = j;
+                p = parse_point_charge_line(p, bounds[i + 1], charges[j]);
+            }
+        }
+    });
+}
 
+// How nearest_neighbor_idx is assigned: adjacent picks the closer of the two neighbors in
+// file order (only right for spatially sorted input), grid searches all particles.
+enum class neighbor_mode { adjacent, grid };
+
+inline neighbor_mode parse_neighbor_mode(const std::string& name) {
+    return name == "grid" ? neighbor_mode::grid : neighbor_mode::adjacent;
+}
+
+inline void assign_adjacent_neighbors(std::vector<point_charge>& charges) {
     charges[0].nearest_neighbor_idx = 1;
     charges.back().nearest_neighbor_idx = charges.size() - 2;
     for (int i = 1; i < charges.size() - 1; i ++) {
@@ -61,14 +165,108 @@ std::vector<point_charge> setup_point_charges(const std::string& filename, int m
             charges[i].nearest_neighbor_idx = i + 1;
         }
     }
+}
 
+inline void assign_grid_neighbors(std::vector<point_charge>& charges, int num_threads) {
+    const int n = charges.size();
+    std::vector<int32_t> x(n), y(n), nearest(n);
+    for (int i = 0; i < n; i ++) {
+        x[i] = charges[i].x;
+        y[i] = charges[i].y;
+    }
+    spatial_grid grid;
+    grid.build(x.data(), y.data(), n, num_threads);
+    grid.nearest_all(nearest.data(), num_threads);
+    for (int i = 0; i < n; i ++) {
+        charges[i].nearest_neighbor_idx = nearest[i];
+    }
+}
+
+// Maps filename and parses up to max_line records from [begin_byte, end_byte) of it; both ends are
+// moved forward to the next line start unless they sit on the start or end of the file. An
+// end_byte of -1 means the end of the file. idx numbers the parsed lines from 0.
+inline std::vector<point_charge> read_point_charges(const std::string& filename, int max_line, int num_threads=1, off_t begin_byte=0, off_t end_byte=-1) {
+    trace_span span("read point charges", "read");
+    std::vector<point_charge> charges;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return charges;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            const char* data = static_cast<const char*>(mapped);
+            const char* file_end = data + st.st_size;
+            const char* begin = begin_byte > 0 ? next_line_start(data + std::min<off_t>(begin_byte, st.st_size) - 1, file_end) : data;
+            const char* end = (end_byte >= 0 && end_byte < st.st_size) ? (end_byte > 0 ? next_line_start(data + end_byte - 1, file_end) : data) : file_end;
+            if (begin < end) {
+                madvise(const_cast<char*>(begin), end - begin, MADV_SEQUENTIAL);
+                charges.reserve(std::max<int>(std::min<int64_t>(max_line, (end - begin) / 4 + 1), 0));
+                parse_point_charges(begin, end, max_line, num_threads, charges);
+            }
+            munmap(mapped, st.st_size);
+        }
+    }
+    close(fd);
+    return charges;
+}
+
+std::vector<point_charge> setup_point_charges(const std::string& filename, int max_line=1000, int num_threads=1, neighbor_mode neighbors=neighbor_mode::adjacent) {
+    if (access(filename.c_str(), R_OK) != 0) {
+        return std::vector<point_charge>();
+    }
+    std::vector<point_charge> charges = read_point_charges(filename, max_line, num_threads);
+    
+    if (charges.size() < 2) {
+        std::cerr << "too few points!" << std::endl;
+        return charges;
+    }
+
+    // neighbors are searched among the parsed particles only; tiled copies reuse them
+    trace_span span("assign neighbors", "partition");
+    if (neighbors == neighbor_mode::grid) {
+        assign_grid_neighbors(charges, num_threads);
+    } else {
+        assign_adjacent_neighbors(charges);
+    }
+
+    // tile the parsed particles until max_line is reached
     int old_size = charges.size();
-    while (charges.size() < max_line) {
-        for (int i = 0; i < old_size; i ++) {
-            charges.push_back(charges[i]);
-            charges.back().idx = charges.size() - 1;
-            if (charges.size() == max_line) break;
+    if (old_size < max_line) {
+        charges.resize(max_line);
+        for (int i = old_size; i < max_line; i ++) {
+            charges[i] = charges[i % old_size];
+            charges[i].idx = i;
         }
     }
     return charges;
-}
\ No newline at end of file
+}
+
+// Returns the value of an optional trailing "key=value" argument, or fallback if it is absent.
+inline std::string find_arg(int argc, char* argv[], const std::string& key, const std::string& fallback="") {
+    for (int i = 1; i < argc; i ++) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, key.size() + 1, key + "=") == 0) {
+            return arg.substr(key.size() + 1);
+        }
+    }
+    return fallback;
+}
+
+// False (with a message) if a "key=value" argument is present with a value outside choices, so a
+// typo such as neighbors=gird is rejected instead of quietly running the default.
+inline bool valid_choice(int argc, char* argv[], const std::string& key, std::initializer_list<const char*> choices) {
+    const std::string value = find_arg(argc, argv, key);
+    if (value.empty()) {
+        return true;
+    }
+    for (const char* choice : choices) {
+        if (value == choice) {
+            return true;
+        }
+    }
+    std::cerr << "invalid " << key << "=" << value << std::endl;
+    return false;
+}
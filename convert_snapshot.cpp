@@ -0,0 +1,25 @@
+#include <chrono>
+#include "common.h"
+#include "snapshot.h"
+
+int main(int argc, char* argv[]) {
+    if ((argc != 4 && !(argc == 5 && find_arg(argc, argv, "neighbors") != "")) || !valid_choice(argc, argv, "neighbors", {"adjacent", "grid"})) {
+        std::cerr << "Usage: ./ConvertSnapshot {input.csv} {output.snap} {num_particles} [neighbors={adjacent,grid}]" << std::endl;
+        return -1;
+    }
+    const int num_particles = std::stoi(argv[3]);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<point_charge> charges = setup_point_charges(argv[1], num_particles, std::thread::hardware_concurrency(), parse_neighbor_mode(find_arg(argc, argv, "neighbors")));
+    if (charges.size() < 2) {
+        std::cerr << "could not read particles from " << argv[1] << std::endl;
+        return -1;
+    }
+    if (!write_snapshot(argv[2], charges)) {
+        return -1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Wrote " << charges.size() << " particles to " << argv[2] << " in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
+    return 0;
+}
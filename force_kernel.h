@@ -0,0 +1,293 @@
+#pragma once
+#include <cmath>
+#include <string>
+#include <vector>
+#include "common.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FORCE_KERNEL_X86 1
+#endif
+
+// Force laws on the squared distance r2 in input units (1e-10 m), in newtons. The unit is folded
+// into constexpr constants, so a pair costs only the law's own arithmetic. R is float, double or
+// one of the vector types below; the laws are written once for all of them.
+struct coulomb_law {
+    // kq1q2 / r^2 with r in meters
+    static constexpr double k = kq1q2 * 1e20;
+
+    template <typename R>
+    static R magnitude(const R& r2) {
+        return R(k) / r2;
+    }
+};
+
+// Coulomb softened by one input unit, so coincident particles get a finite force.
+struct softened_coulomb_law {
+    static constexpr double epsilon2 = 1.0;
+
+    template <typename R>
+    static R magnitude(const R& r2) {
+        return R(coulomb_law::k) / (r2 + R(epsilon2));
+    }
+};
+
+// Lennard-Jones with argon's sigma (3.4 input units) and epsilon (1.65e-21 J), positive when
+// repulsive: 24 epsilon / r * (2 (sigma / r)^12 - (sigma / r)^6).
+struct lennard_jones_law {
+    static constexpr double sigma2 = 3.4 * 3.4;
+    static constexpr double k = 24 * 1.65e-21 * 1e10;
+
+    template <typename R>
+    static R magnitude(const R& r2) {
+        using std::sqrt;
+        R s2 = R(sigma2) / r2;
+        R s6 = s2 * s2 * s2;
+        return R(k) * s6 * (s6 + s6 - R(1.0)) / sqrt(r2);
+    }
+};
+
+enum class force_law { coulomb, softened_coulomb, lennard_jones };
+
+inline force_law parse_force_law(const std::string& name) {
+    if (name == "softened") return force_law::softened_coulomb;
+    if (name == "lj") return force_law::lennard_jones;
+    return force_law::coulomb;
+}
+
+inline const char* force_law_name(force_law law) {
+    switch (law) {
+        case force_law::softened_coulomb: return "softened";
+        case force_law::lennard_jones: return "lj";
+        default: return "coulomb";
+    }
+}
+
+// Nearest-neighbor force kernels over particle columns: out[k] is the force on particle start + k.
+// Every variant of a law performs the same IEEE operations per particle, so double results are
+// bitwise identical (in float, AVX-512 may fuse dx * dx + dy * dy and differ in the last bit).
+// The law and precision are template arguments: a kernel is picked once at startup and its loop
+// has no branches on either.
+template <typename Real>
+using basic_nearest_force_kernel = void (*)(const particle_columns& charges, int start, int end, Real* out);
+
+typedef basic_nearest_force_kernel<double> nearest_force_kernel;
+
+template <typename Real=double, typename Law=coulomb_law, typename Coord=int32_t>
+inline void nearest_force_scalar(const basic_particle_columns<Coord>& charges, int start, int end, Real* out) {
+    for (int i = start; i < end; i ++) {
+        const int j = charges.nearest_neighbor_idx[i];
+        const Real dx = charges.x[i] - charges.x[j];
+        const Real dy = charges.y[i] - charges.y[j];
+        out[i - start] = Law::template magnitude<Real>(dx * dx + dy * dy);
+    }
+}
+
+#ifdef FORCE_KERNEL_X86
+// Vectors of Real with the arithmetic the laws use, plus difference(), which gathers the
+// coordinate of each lane's nearest neighbor and subtracts it as int32 like the scalar loop does.
+// Twice as many floats as doubles fit a register, so the float kernels do twice the particles.
+template <typename Real> struct avx2_vector;
+template <typename Real> struct avx512_vector;
+
+template <>
+struct avx2_vector<double> {
+    static constexpr int width = 4;
+    __m256d v;
+
+    __attribute__((target("avx2"))) explicit avx2_vector(__m256d v) : v(v) {}
+    __attribute__((target("avx2"))) explicit avx2_vector(double c) : v(_mm256_set1_pd(c)) {}
+
+    __attribute__((target("avx2")))
+    static avx2_vector difference(const int32_t* coord, const int32_t* nearest, int i) {
+        __m128i nn = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nearest + i));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coord + i));
+        __m128i nc = _mm_i32gather_epi32(reinterpret_cast<const int*>(coord), nn, 4);
+        return avx2_vector(_mm256_cvtepi32_pd(_mm_sub_epi32(c, nc)));
+    }
+
+    __attribute__((target("avx2"))) void store(double* out) const { _mm256_storeu_pd(out, v); }
+};
+
+__attribute__((target("avx2"))) inline avx2_vector<double> operator+(const avx2_vector<double>& a, const avx2_vector<double>& b) { return avx2_vector<double>(_mm256_add_pd(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<double> operator-(const avx2_vector<double>& a, const avx2_vector<double>& b) { return avx2_vector<double>(_mm256_sub_pd(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<double> operator*(const avx2_vector<double>& a, const avx2_vector<double>& b) { return avx2_vector<double>(_mm256_mul_pd(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<double> operator/(const avx2_vector<double>& a, const avx2_vector<double>& b) { return avx2_vector<double>(_mm256_div_pd(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<double> sqrt(const avx2_vector<double>& a) { return avx2_vector<double>(_mm256_sqrt_pd(a.v)); }
+
+template <>
+struct avx2_vector<float> {
+    static constexpr int width = 8;
+    __m256 v;
+
+    __attribute__((target("avx2"))) explicit avx2_vector(__m256 v) : v(v) {}
+    __attribute__((target("avx2"))) explicit avx2_vector(double c) : v(_mm256_set1_ps(c)) {}
+
+    __attribute__((target("avx2")))
+    static avx2_vector difference(const int32_t* coord, const int32_t* nearest, int i) {
+        __m256i nn = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nearest + i));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coord + i));
+        __m256i nc = _mm256_i32gather_epi32(reinterpret_cast<const int*>(coord), nn, 4);
+        return avx2_vector(_mm256_cvtepi32_ps(_mm256_sub_epi32(c, nc)));
+    }
+
+    __attribute__((target("avx2"))) void store(float* out) const { _mm256_storeu_ps(out, v); }
+};
+
+__attribute__((target("avx2"))) inline avx2_vector<float> operator+(const avx2_vector<float>& a, const avx2_vector<float>& b) { return avx2_vector<float>(_mm256_add_ps(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<float> operator-(const avx2_vector<float>& a, const avx2_vector<float>& b) { return avx2_vector<float>(_mm256_sub_ps(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<float> operator*(const avx2_vector<float>& a, const avx2_vector<float>& b) { return avx2_vector<float>(_mm256_mul_ps(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<float> operator/(const avx2_vector<float>& a, const avx2_vector<float>& b) { return avx2_vector<float>(_mm256_div_ps(a.v, b.v)); }
+__attribute__((target("avx2"))) inline avx2_vector<float> sqrt(const avx2_vector<float>& a) { return avx2_vector<float>(_mm256_sqrt_ps(a.v)); }
+
+template <>
+struct avx512_vector<double> {
+    static constexpr int width = 8;
+    __m512d v;
+
+    __attribute__((target("avx512f"))) explicit avx512_vector(__m512d v) : v(v) {}
+    __attribute__((target("avx512f"))) explicit avx512_vector(double c) : v(_mm512_set1_pd(c)) {}
+
+    __attribute__((target("avx512f")))
+    static avx512_vector difference(const int32_t* coord, const int32_t* nearest, int i) {
+        __m256i nn = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nearest + i));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coord + i));
+        __m256i nc = _mm256_i32gather_epi32(reinterpret_cast<const int*>(coord), nn, 4);
+        return avx512_vector(_mm512_cvtepi32_pd(_mm256_sub_epi32(c, nc)));
+    }
+
+    __attribute__((target("avx512f"))) void store(double* out) const { _mm512_storeu_pd(out, v); }
+};
+
+__attribute__((target("avx512f"))) inline avx512_vector<double> operator+(const avx512_vector<double>& a, const avx512_vector<double>& b) { return avx512_vector<double>(_mm512_add_pd(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<double> operator-(const avx512_vector<double>& a, const avx512_vector<double>& b) { return avx512_vector<double>(_mm512_sub_pd(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<double> operator*(const avx512_vector<double>& a, const avx512_vector<double>& b) { return avx512_vector<double>(_mm512_mul_pd(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<double> operator/(const avx512_vector<double>& a, const avx512_vector<double>& b) { return avx512_vector<double>(_mm512_div_pd(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<double> sqrt(const avx512_vector<double>& a) { return avx512_vector<double>(_mm512_sqrt_pd(a.v)); }
+
+template <>
+struct avx512_vector<float> {
+    static constexpr int width = 16;
+    __m512 v;
+
+    __attribute__((target("avx512f"))) explicit avx512_vector(__m512 v) : v(v) {}
+    __attribute__((target("avx512f"))) explicit avx512_vector(double c) : v(_mm512_set1_ps(c)) {}
+
+    __attribute__((target("avx512f")))
+    static avx512_vector difference(const int32_t* coord, const int32_t* nearest, int i) {
+        __m512i nn = _mm512_loadu_si512(nearest + i);
+        __m512i c = _mm512_loadu_si512(coord + i);
+        __m512i nc = _mm512_i32gather_epi32(nn, coord, 4);
+        return avx512_vector(_mm512_cvtepi32_ps(_mm512_sub_epi32(c, nc)));
+    }
+
+    __attribute__((target("avx512f"))) void store(float* out) const { _mm512_storeu_ps(out, v); }
+};
+
+__attribute__((target("avx512f"))) inline avx512_vector<float> operator+(const avx512_vector<float>& a, const avx512_vector<float>& b) { return avx512_vector<float>(_mm512_add_ps(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<float> operator-(const avx512_vector<float>& a, const avx512_vector<float>& b) { return avx512_vector<float>(_mm512_sub_ps(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<float> operator*(const avx512_vector<float>& a, const avx512_vector<float>& b) { return avx512_vector<float>(_mm512_mul_ps(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<float> operator/(const avx512_vector<float>& a, const avx512_vector<float>& b) { return avx512_vector<float>(_mm512_div_ps(a.v, b.v)); }
+__attribute__((target("avx512f"))) inline avx512_vector<float> sqrt(const avx512_vector<float>& a) { return avx512_vector<float>(_mm512_sqrt_ps(a.v)); }
+
+// flatten pulls the law and the vector operators into the kernel, where the target allows them
+template <typename Real=double, typename Law=coulomb_law>
+__attribute__((target("avx2"), flatten))
+inline void nearest_force_avx2(const particle_columns& charges, int start, int end, Real* out) {
+    typedef avx2_vector<Real> lanes;
+    int i = start;
+    for (; i + lanes::width <= end; i += lanes::width) {
+        lanes dx = lanes::difference(charges.x, charges.nearest_neighbor_idx, i);
+        lanes dy = lanes::difference(charges.y, charges.nearest_neighbor_idx, i);
+        Law::magnitude(dx * dx + dy * dy).store(out + (i - start));
+    }
+    nearest_force_scalar<Real, Law>(charges, i, end, out + (i - start));
+}
+
+template <typename Real=double, typename Law=coulomb_law>
+__attribute__((target("avx512f"), flatten))
+inline void nearest_force_avx512(const particle_columns& charges, int start, int end, Real* out) {
+    typedef avx512_vector<Real> lanes;
+    int i = start;
+    for (; i + lanes::width <= end; i += lanes::width) {
+        lanes dx = lanes::difference(charges.x, charges.nearest_neighbor_idx, i);
+        lanes dy = lanes::difference(charges.y, charges.nearest_neighbor_idx, i);
+        Law::magnitude(dx * dx + dy * dy).store(out + (i - start));
+    }
+    nearest_force_scalar<Real, Law>(charges, i, end, out + (i - start));
+}
+#endif
+
+// Picks the widest kernel of the law the CPU supports; isa ("scalar", "avx2", "avx512") caps the choice.
+template <typename Real, typename Law>
+inline basic_nearest_force_kernel<Real> select_law_kernel(const std::string& isa) {
+#ifdef FORCE_KERNEL_X86
+    __builtin_cpu_init();
+    if ((isa.empty() || isa == "avx512") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")) {
+        return nearest_force_avx512<Real, Law>;
+    }
+    if ((isa.empty() || isa == "avx512" || isa == "avx2") && __builtin_cpu_supports("avx2")) {
+        return nearest_force_avx2<Real, Law>;
+    }
+#endif
+    return nearest_force_scalar<Real, Law>;
+}
+
+template <typename Real=double>
+inline basic_nearest_force_kernel<Real> select_nearest_force_kernel(const std::string& isa = "", force_law law = force_law::coulomb) {
+    switch (law) {
+        case force_law::softened_coulomb: return select_law_kernel<Real, softened_coulomb_law>(isa);
+        case force_law::lennard_jones: return select_law_kernel<Real, lennard_jones_law>(isa);
+        default: return select_law_kernel<Real, coulomb_law>(isa);
+    }
+}
+
+// The instruction set of kernel if it is one of Law's, otherwise nullptr.
+template <typename Real, typename Law>
+inline const char* law_kernel_name(basic_nearest_force_kernel<Real> kernel) {
+#ifdef FORCE_KERNEL_X86
+    if (kernel == nearest_force_avx512<Real, Law>) return "avx512";
+    if (kernel == nearest_force_avx2<Real, Law>) return "avx2";
+#endif
+    if (kernel == nearest_force_scalar<Real, Law>) return "scalar";
+    return nullptr;
+}
+
+template <typename Real>
+inline const char* nearest_force_kernel_name(basic_nearest_force_kernel<Real> kernel) {
+    const char* name = law_kernel_name<Real, coulomb_law>(kernel);
+    if (!name) name = law_kernel_name<Real, softened_coulomb_law>(kernel);
+    if (!name) name = law_kernel_name<Real, lennard_jones_law>(kernel);
+    return name ? name : "scalar";
+}
+
+// Resolved once per process so the hot loops never re-check the CPU.
+inline nearest_force_kernel default_nearest_force_kernel() {
+    static const nearest_force_kernel kernel = select_nearest_force_kernel();
+    return kernel;
+}
+
+// Relative error of single-precision forces against the double kernel of the same law, which is
+// run on evenly spaced sample particles only. Samples whose exact force is zero or not finite
+// (coincident neighbors) are left out.
+inline approximation_error single_precision_error(const particle_columns& charges, const std::vector<float>& forces, nearest_force_kernel exact_kernel, int samples) {
+    approximation_error error;
+    const int n = std::min<size_t>(charges.count, forces.size());
+    samples = std::min(samples, n);
+    double sum_square = 0;
+    for (int k = 0; k < samples; k ++) {
+        const int i = static_cast<int64_t>(k) * n / samples;
+        double exact;
+        exact_kernel(charges, i, i + 1, &exact);
+        if (exact == 0 || !std::isfinite(exact)) {
+            continue;
+        }
+        const double relative = std::abs((forces[i] - exact) / exact);
+        error.max_relative = std::max(error.max_relative, relative);
+        sum_square += relative * relative;
+        error.samples ++;
+    }
+    if (error.samples > 0) {
+        error.rms_relative = std::sqrt(sum_square / error.samples);
+    }
+    return error;
+}
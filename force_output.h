@@ -0,0 +1,156 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <charconv>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "thread_pool.h"
+#include "trace.h"
+
+// Force results on their way to a file. text is the "ID: 1, Force=4.60288e-09" listing that
+// mpi.txt, verification_results.csv and test_outputs.py use (6 significant digits); csv is
+// "id,force" with the shortest digits that read back to the same double; binary is the forces as
+// native doubles. Ids are 1-based in both text formats.
+enum class output_format { text, csv, binary };
+
+inline output_format parse_output_format(const std::string& name) {
+    if (name == "csv") return output_format::csv;
+    if (name == "binary") return output_format::binary;
+    return output_format::text;
+}
+
+// Where results go: nowhere while file is empty, stdout for "-" (single-process runs only).
+struct output_config {
+    std::string file;
+    output_format format = output_format::text;
+};
+
+// Appends forces[0, count) for ids first_id + 1, ... to out.
+inline void format_forces(const double* forces, size_t count, int64_t first_id, output_format format, std::vector<char>& out) {
+    if (format == output_format::binary) {
+        const char* bytes = reinterpret_cast<const char*>(forces);
+        out.insert(out.end(), bytes, bytes + count * sizeof(double));
+        return;
+    }
+    // "ID: " + 20-digit id + ", Force=" + 24-char double + '\n' always fits
+    const size_t start = out.size();
+    out.resize(start + count * 64);
+    char* p = out.data() + start;
+    char* const end = out.data() + out.size();
+    for (size_t k = 0; k < count; k ++) {
+        if (format == output_format::text) {
+            std::memcpy(p, "ID: ", 4);
+            p = std::to_chars(p + 4, end, first_id + k + 1).ptr;
+            std::memcpy(p, ", Force=", 8);
+            p = std::to_chars(p + 8, end, forces[k], std::chars_format::general, 6).ptr;
+        } else {
+            p = std::to_chars(p, end, first_id + k + 1).ptr;
+            *p ++ = ',';
+            p = std::to_chars(p, end, forces[k]).ptr;
+        }
+        *p ++ = '\n';
+    }
+    out.resize(p - out.data());
+}
+
+// format_forces on the global pool: blocks of grain forces are formatted side by side into
+// blocks[i] (reusing their capacity), which then hold consecutive pieces of the output.
+inline void format_forces_parallel(const double* forces, size_t count, int64_t first_id, output_format format,
+                                   std::vector<std::vector<char>>& blocks, int grain=1 << 16) {
+    trace_span span("format forces", "gather");
+    const size_t block_count = (count + grain - 1) / grain;
+    blocks.resize(block_count);
+    thread_pool::global().parallel_for(0, block_count, 1, [&](int first, int last) {
+        for (int b = first; b < last; b ++) {
+            const size_t begin = static_cast<size_t>(b) * grain;
+            blocks[b].clear();
+            format_forces(forces + begin, std::min<size_t>(grain, count - begin), first_id + begin, format, blocks[b]);
+        }
+    });
+}
+
+// Writes all of data, retrying short writes; false (with a message) on error.
+inline bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "could not write output: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Writes consecutive blocks with as few writev calls as IOV_MAX allows.
+inline bool write_blocks(int fd, const std::vector<std::vector<char>>& blocks) {
+    std::vector<iovec> pieces;
+    for (const auto & block : blocks) {
+        if (!block.empty()) {
+            pieces.push_back(iovec{const_cast<char*>(block.data()), block.size()});
+        }
+    }
+    for (size_t first = 0; first < pieces.size(); first += IOV_MAX) {
+        const size_t last = std::min<size_t>(pieces.size(), first + IOV_MAX);
+        ssize_t written = writev(fd, pieces.data() + first, last - first);
+        if (written < 0 && errno != EINTR) {
+            std::cerr << "could not write output: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        // a short writev is finished piece by piece
+        size_t done = std::max<ssize_t>(written, 0);
+        for (size_t i = first; i < last; i ++) {
+            const size_t len = pieces[i].iov_len;
+            if (done >= len) {
+                done -= len;
+                continue;
+            }
+            if (!write_all(fd, static_cast<const char*>(pieces[i].iov_base) + done, len - done)) {
+                return false;
+            }
+            done = 0;
+        }
+    }
+    return true;
+}
+
+// Writes forces to filename ("-" is stdout); false if it could not be written.
+inline bool write_forces(const std::string& filename, const std::vector<double>& forces, output_format format) {
+    int fd = (filename == "-") ? STDOUT_FILENO : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "could not write " << filename << std::endl;
+        return false;
+    }
+    bool ok;
+    if (format == output_format::binary) {
+        ok = write_all(fd, reinterpret_cast<const char*>(forces.data()), forces.size() * sizeof(double));
+    } else {
+        // a few blocks per thread at a time keeps the text buffers small
+        std::vector<std::vector<char>> blocks;
+        const size_t round = static_cast<size_t>(4 * thread_pool::global().size()) << 16;
+        ok = true;
+        for (size_t begin = 0; ok && begin < forces.size(); begin += round) {
+            format_forces_parallel(forces.data() + begin, std::min(round, forces.size() - begin), begin, format, blocks);
+            ok = write_blocks(fd, blocks);
+        }
+    }
+    if (fd != STDOUT_FILENO) {
+        ok = (close(fd) == 0) && ok;
+    }
+    return ok;
+}
+
+// The "ID: n, Force=f" listing on stdout, formatted in bulk instead of line by line.
+inline void print_force(const std::vector<double>& forces) {
+    std::cout.flush();
+    write_forces("-", forces, output_format::text);
+}
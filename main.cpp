@@ -1,7 +1,15 @@
 #include <chrono>
 #include <thread>
-#include <mutex>
 #include "common.h"
+#include "thread_pool.h"
+#include "snapshot.h"
+#include "particle_store.h"
+#include "force_kernel.h"
+#include "nbody.h"
+#include "barnes_hut.h"
+#include "simulation.h"
+#include "streaming.h"
+#include "force_output.h"
 
 
 void test_file_not_found() {
@@ -30,128 +38,250 @@ void test_file_content() {
     }
 }
 
-std::vector<double> serial_calculation(const std::vector<point_charge>& charges) {
-    std::vector<double> ans;
-    for (int i = 0; i < charges.size(); i ++) {
-        ans.push_back(kq1q2 / distance_between_square(charges[i], charges[charges[i].nearest_neighbor_idx]));
-    }
+template <typename Real=double>
+std::vector<Real> serial_calculation(const particle_columns& charges, basic_nearest_force_kernel<Real> kernel=default_nearest_force_kernel()) {
+    std::vector<Real> ans(charges.count);
+    kernel(charges, 0, charges.count, ans.data());
     return ans;
 }
 
 
-// large time between the earliest thread stated that the main thread finished creating threads, i.e. started to wait for join
-
-void thread_worker(const std::vector<point_charge> charges, int start, int end, std::vector<double>& ans) {
-    std::thread::id thread_id = std::this_thread::get_id();
-    auto start_time = std::chrono::high_resolution_clock::now();
-    auto start_now = std::chrono::system_clock::now();
-    for (int i = start; i < end; i ++) {
-        ans[i] = kq1q2 / distance_between_square(charges[i], charges[charges[i].nearest_neighbor_idx]);
-    }
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-    auto now = std::chrono::system_clock::now();
-    // std::cout << "Thread: " << thread_id << " finished in " << duration.count() 
-    //         << " microseconds, started at:" << std::chrono::duration_cast<std::chrono::microseconds>(start_now.time_since_epoch()).count()
-    //         << ", finished at:" << std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count() << "\n";
+// Thread start-up and join skew used to be chased with timing code here; trace={file} now records
+// every chunk and the wait for the last one as spans on the thread that ran them.
+template <typename Real>
+void thread_worker(const particle_columns& charges, int start, int end, std::vector<Real>& ans, basic_nearest_force_kernel<Real> kernel) {
+    kernel(charges, start, end, ans.data() + start);
 }
 
 
-std::vector<double> multithread_calculation(const std::vector<point_charge>& charges, int num_threads=4) {
-    std::vector<double> ans(charges.size());
-    std::vector<std::thread> threads(num_threads);
-
-    int chunk_size = charges.size() / num_threads;
-    int remainder  = charges.size() % num_threads;
+// Runs on the global pool, which is sized once in main; grain=0 lets the pool pick the chunk size.
+template <typename Real=double>
+std::vector<Real> multithread_calculation(const particle_columns& charges, int num_threads=4, basic_nearest_force_kernel<Real> kernel=default_nearest_force_kernel(), int grain=0) {
+    std::vector<Real> ans(charges.count);
 
-    if (chunk_size < 1) {
-        std::cerr << "too many threads, not enough data!" << " num_threads=" << num_threads << ", num_particles=" << charges.size() << std::endl;
+    if (charges.count / num_threads < 1) {
+        std::cerr << "too many threads, not enough data!" << " num_threads=" << num_threads << ", num_particles=" << charges.count << std::endl;
         return ans;
     }
 
-    int start = 0;
-    for(int i = 0; i < num_threads; i ++) {
-        int size = (i < remainder) ? chunk_size + 1 : chunk_size;
-        // threads.push_back(std::thread(thread_worker, std::cref(charges), start, start + size, std::ref(ans)));
-        threads[i] = (std::thread(thread_worker, std::cref(charges), start, start + size, std::ref(ans)));
-        start += size;
-    }
-
-
-    // for (auto & thread : threads) {
-    //     thread.join();
-    // }
-    // auto join_start_time = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < threads.size(); i ++) {
-        // auto join_start_time_i = std::chrono::system_clock::now();
-        // auto join_start = std::chrono::high_resolution_clock::now();
-        // std::thread::id tid = threads[i].get_id();
-        threads[i].join();
-        // auto join_end = std::chrono::high_resolution_clock::now();
-        // auto join_duration = std::chrono::duration_cast<std::chrono::microseconds>(join_end - join_start).count();
-        // std::cout << "Time to join thread id:" << tid << " : " << join_duration << " microseconds. started at: " << std::chrono::duration_cast<std::chrono::microseconds>(join_start_time_i.time_since_epoch()).count() << std::endl;
-    }
-    // auto join_end_time = std::chrono::high_resolution_clock::now();
-    // std::cout << "Time to join thread: " << std::chrono::duration_cast<std::chrono::microseconds>(join_end_time - join_start_time).count() << " microseconds." << std::endl;
+    thread_pool::global().parallel_for(0, charges.count, grain, [&](int start, int end) {
+        thread_worker(charges, start, end, ans, kernel);
+    });
     return ans;
 }
 
 
 int main(int argc, char* argv[]) {
     if (argc < 3 || std::string(argv[1]).find("mode=") == std::string::npos || std::string(argv[2]).find("num_particles=") == std::string::npos) {
-        std::cerr << "Usage: ./ForceCalculation mode={1-2} num_particles={d+} num_threads={d+}" << std::endl;
+        std::cerr << "Usage: ./ForceCalculation mode={1-6} num_particles={d+} num_threads={d+} [snapshot={file}] [kernel={scalar,avx2,avx512}] [law={coulomb,softened,lj}] [precision={double,float}] [neighbors={adjacent,grid}] [theta={f}] [error_samples={d+}] [grain={d+}] [pin_threads={0,1}] [steps={d+}] [dt={f}] [mass={f}] [skin={f}] [checkpoint_every={d+}] [checkpoint_prefix={path}] [window={bytes}] [output={file}] [format={text,csv,binary}] [skip_tests={0,1}] [trace={file}] [trace_counters={0,1}]" << std::endl;
         return -1;
     }
 
+    // skip_tests=1 keeps benchmark runs to the work itself
     auto start = std::chrono::high_resolution_clock::now();
-    test_file_not_found();
-    test_file_open();
-    test_file_content();
-    auto end = std::chrono::high_resolution_clock::now();
-    std::cout << "Time to run tests: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
+    auto end = start;
+    if (find_arg(argc, argv, "skip_tests", "0") != "1") {
+        test_file_not_found();
+        test_file_open();
+        test_file_content();
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "Time to run tests: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
+    }
 
     int mode = std::stoi(std::string(argv[1]).substr(5));
     int num_particles = std::stoi(std::string(argv[2]).substr(14));
     int num_threads = 0;
 
-    if (mode == 1) {
-        if (argc !=3) {
-        std::cerr << "Usage: ./ForceCalculation mode={1-2} num_particles={d+}" << std::endl;
+    const std::string snapshot_file = find_arg(argc, argv, "snapshot");
+    const std::string usage = "Usage: ./ForceCalculation mode={1-6} num_particles={d+} num_threads={d+} [snapshot={file}] [kernel={scalar,avx2,avx512}] [law={coulomb,softened,lj}] [precision={double,float}] [neighbors={adjacent,grid}] [theta={f}] [error_samples={d+}] [grain={d+}] [pin_threads={0,1}] [steps={d+}] [dt={f}] [mass={f}] [skin={f}] [checkpoint_every={d+}] [checkpoint_prefix={path}] [window={bytes}] [output={file}] [format={text,csv,binary}] [skip_tests={0,1}] [trace={file}] [trace_counters={0,1}]";
+    const int required_args = (mode >= 2) ? 4 : 3;
+    if (argc < required_args || (mode >= 2 && std::string(argv[3]).find("num_threads=") == std::string::npos)) {
+        std::cerr << usage << std::endl;
         return -1;
     }
-    } else if (mode == 2) {
-        if (argc != 4) {
-            std::cerr << "Usage: ./ForceCalculation mode={1-2} num_particles={d+} num_threads={d+}" << std::endl;
+    for (int i = required_args; i < argc; i ++) {
+        if (std::string(argv[i]).find('=') == std::string::npos) {
+            std::cerr << usage << std::endl;
             return -1;
         }
+    }
+    if (!valid_choice(argc, argv, "kernel", {"scalar", "avx2", "avx512"}) || !valid_choice(argc, argv, "neighbors", {"adjacent", "grid"})
+        || !valid_choice(argc, argv, "law", {"coulomb", "softened", "lj"}) || !valid_choice(argc, argv, "precision", {"double", "float"})
+        || !valid_choice(argc, argv, "format", {"text", "csv", "binary"})) {
+        std::cerr << usage << std::endl;
+        return -1;
+    }
+    if (mode >= 2) {
         num_threads = std::stoi(std::string(argv[3]).substr(12));
     }
+    const std::string trace_file = find_arg(argc, argv, "trace");
+    if (!trace_file.empty()) {
+        tracer::name_thread("main");
+        tracer::instance().start(find_arg(argc, argv, "trace_counters", "1") == "1");
+    }
+    thread_pool::configure(std::max(num_threads, 1), find_arg(argc, argv, "pin_threads", "0") == "1");
+    const int grain = std::stoi(find_arg(argc, argv, "grain", "0"));
+    const neighbor_mode neighbors = parse_neighbor_mode(find_arg(argc, argv, "neighbors"));
+    // the law and precision of the nearest-neighbor modes are fixed here, not checked per particle
+    const force_law law = parse_force_law(find_arg(argc, argv, "law"));
+    const bool single_precision = find_arg(argc, argv, "precision", "double") == "float";
+    if ((law != force_law::coulomb && mode != 1 && mode != 2 && mode != 6) || (single_precision && mode != 1 && mode != 2)) {
+        std::cerr << "law= applies to modes 1, 2 and 6, precision=float to modes 1 and 2" << std::endl;
+        return -1;
+    }
+    nearest_force_kernel kernel = select_nearest_force_kernel(find_arg(argc, argv, "kernel"), law);
+    basic_nearest_force_kernel<float> float_kernel = select_nearest_force_kernel<float>(find_arg(argc, argv, "kernel"), law);
+    nbody_tile_kernel tile_kernel = select_nbody_tile_kernel(find_arg(argc, argv, "kernel"));
+    if (mode == 3) {
+        std::cout << "Using " << nbody_tile_kernel_name(tile_kernel) << " force kernel." << std::endl;
+    } else if (mode < 4 || mode == 6) {
+        std::cout << "Using " << (single_precision ? nearest_force_kernel_name(float_kernel) : nearest_force_kernel_name(kernel)) << " force kernel for the "
+                  << force_law_name(law) << " law in " << (single_precision ? "float" : "double") << " precision." << std::endl;
+    }
 
+    // mode=6 never holds the whole input: windows of it are read, computed and written out in turn
+    if (mode == 6) {
+        if (neighbors != neighbor_mode::adjacent || !snapshot_file.empty()) {
+            std::cerr << "mode=6 streams the CSV and only supports neighbors=adjacent" << std::endl;
+            return -1;
+        }
+        stream_config stream;
+        stream.window_bytes = std::stoll(find_arg(argc, argv, "window", std::to_string(stream.window_bytes)));
+        stream.output = find_arg(argc, argv, "output");
+        stream.format = parse_output_format(find_arg(argc, argv, "format"));
+        stream.grain = grain;
+        stream_stats stats;
+        start = std::chrono::high_resolution_clock::now();
+        if (!stream_nearest_forces("./particles-student-1.csv", num_particles, stream, num_threads, kernel, stats)) {
+            return -1;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "Time to read file and calculate force for mode=6 took " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+                  << " microseconds." << std::endl;
+        std::cout << "Streamed " << stats.particles << " particles in " << stats.windows << " windows of up to " << stream.window_bytes << " bytes." << std::endl;
+        if (!trace_file.empty()) {
+            tracer::instance().stop();
+            tracer::write(trace_file, tracer::instance().events_json(0, "ForceCalculation"));
+        }
+        return 0;
+    }
+
+    // the snapshot is used in place; num_particles must not exceed what it was written with
+    particle_store store;
+    particle_snapshot snapshot;
+    particle_columns columns;
     start = std::chrono::high_resolution_clock::now();
-    std::vector<point_charge> charges = setup_point_charges("./particles-student-1.csv", num_particles);
+    trace_span read_span("read file", "read");
+    if (snapshot_file.empty()) {
+        store = particle_store(setup_point_charges("./particles-student-1.csv", num_particles, std::max(num_threads, 1), neighbors));
+        columns = store.columns();
+    } else if (!snapshot.load(snapshot_file)) {
+        return -1;
+    } else if (snapshot.size() < num_particles) {
+        std::cerr << "snapshot " << snapshot_file << " only holds " << snapshot.size() << " particles" << std::endl;
+        return -1;
+    } else {
+        columns = snapshot.columns();
+        columns.count = num_particles;
+    }
+    read_span.end();
     end = std::chrono::high_resolution_clock::now();
     std::cout << "Time to read file: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
 
     std::vector<double> ans;
+    std::vector<float> single_ans;
+    net_forces approximate;
+    const double theta = std::stod(find_arg(argc, argv, "theta", "0.5"));
+    particle_state state;
+    simulation_config config;
+    simulation_stats stats;
+    if (mode == 5) {
+        config.steps = std::stoi(find_arg(argc, argv, "steps", "10"));
+        config.dt = std::stod(find_arg(argc, argv, "dt", "1e-15"));
+        config.mass = std::stod(find_arg(argc, argv, "mass", "1.67e-27"));
+        config.skin = std::stod(find_arg(argc, argv, "skin", "0"));
+        config.checkpoint_every = std::stoi(find_arg(argc, argv, "checkpoint_every", "0"));
+        config.checkpoint_prefix = find_arg(argc, argv, "checkpoint_prefix", "checkpoint");
+        config.grain = grain;
+        state = make_particle_state(columns);
+    }
 
     start = std::chrono::high_resolution_clock::now();
+    trace_span compute_span("calculate force", "compute");
     switch (mode)
     {
         case 1:
-            ans = serial_calculation(charges);
+            if (single_precision) {
+                single_ans = serial_calculation(columns, float_kernel);
+            } else {
+                ans = serial_calculation(columns, kernel);
+            }
             break;
 
         case 2:
-            ans = multithread_calculation(charges, num_threads);
+            if (single_precision) {
+                single_ans = multithread_calculation(columns, num_threads, float_kernel, grain);
+            } else {
+                ans = multithread_calculation(columns, num_threads, kernel, grain);
+            }
+            break;
+
+        case 3:
+            ans = all_pairs_calculation(columns, num_threads, tile_kernel).magnitudes();
+            break;
+
+        case 4:
+            approximate = barnes_hut_calculation(columns, theta, num_threads);
+            ans = approximate.magnitudes();
+            break;
+
+        case 5:
+            stats = run_simulation(state, config, std::max(num_threads, 1));
             break;
         
         default:
             std::cerr << "Invalid mode value: " << mode << std::endl;
             return -1;
     }
+    compute_span.end();
     end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
     std::cout << "Time to calculate force for mode=" << mode << " took " << duration << " microseconds." << std::endl;
-    // print_force(ans);
+    if (mode == 3) {
+        double interactions = static_cast<double>(columns.count) * (columns.count - 1);
+        std::cout << "Interactions per second: " << interactions / (std::max<long long>(duration, 1) * 1E-6) << std::endl;
+    }
+    if (mode == 4) {
+        approximation_error error = sample_force_error(columns, approximate, std::stoi(find_arg(argc, argv, "error_samples", "100")), num_threads);
+        std::cout << "Barnes-Hut theta=" << theta << " error vs exact on " << error.samples << " samples: max=" << error.max_relative
+                  << ", rms=" << error.rms_relative << std::endl;
+    }
+    // float results are checked against the double kernel of the same law on error_samples particles
+    if (single_precision) {
+        approximation_error error = single_precision_error(columns, single_ans, kernel, std::stoi(find_arg(argc, argv, "error_samples", "100")));
+        std::cout << "float vs double on " << error.samples << " samples: max=" << error.max_relative << ", rms=" << error.rms_relative << std::endl;
+    }
+    if (mode == 5) {
+        double seconds = std::max(stats.seconds, 1E-6);
+        std::cout << "Simulated " << stats.steps << " steps with " << stats.rebuilds << " neighbor list rebuilds: " << stats.steps / seconds
+                  << " steps per second, " << static_cast<double>(stats.steps) * state.size() / seconds << " particle-steps per second." << std::endl;
+    }
+    // output=- prints the forces; mode=5 leaves its results in the checkpoints
+    const std::string output_file = find_arg(argc, argv, "output");
+    if (!output_file.empty() && mode != 5) {
+        start = std::chrono::high_resolution_clock::now();
+        if (single_precision) {
+            ans.assign(single_ans.begin(), single_ans.end());
+        }
+        if (!write_forces(output_file, ans, parse_output_format(find_arg(argc, argv, "format")))) {
+            return -1;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "Time to write output: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
+    }
+    if (!trace_file.empty()) {
+        tracer::instance().stop();
+        tracer::write(trace_file, tracer::instance().events_json(0, "ForceCalculation"));
+    }
     return 0;
 }
\ No newline at end of file
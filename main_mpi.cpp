@@ -1,142 +1,1394 @@
 #include <cstddef>
-#include <queue>
-#include <mutex>
 #include <mpi.h>
-#include <future>
 #include "common.h"
+#include "thread_pool.h"
+#include "snapshot.h"
+#include "particle_store.h"
+#include "force_kernel.h"
+#include "nbody.h"
+#include "barnes_hut.h"
+#include "simulation.h"
+#include "force_output.h"
 
 MPI_Datatype MPI_POINT_CHARGE;
-std::mutex mtx;
 
 
-void thread_worker(std::queue<std::vector<point_charge>>& charges_queue, const std::vector<point_charge>& all_charges, std::vector<double>& results, int offset) {
-    while (true) {
-        std::vector<point_charge> charges;
-        {
-            std::lock_guard<std::mutex> lk(mtx);
-            if (charges_queue.empty()) {
-                return;
-            }
-            charges = std::move(charges_queue.front());
-            charges_queue.pop();
+// Computes global particles [begin, end) into results (this rank's slice) on the shared pool.
+void compute_slice(const particle_columns& all_charges, int begin, int end, int grain, std::vector<double>& results) {
+    nearest_force_kernel kernel = default_nearest_force_kernel();
+    thread_pool::global().parallel_for(begin, end, grain, [&](int start, int stop) {
+        kernel(all_charges, start, stop, results.data() + (start - begin));
+    });
+}
+
+// Maps the snapshot on every rank; fails everywhere if any rank could not use it.
+bool load_snapshot_everywhere(particle_snapshot& snapshot, const std::string& snapshot_file, int num_particles, int rank) {
+    int ok = snapshot.load(snapshot_file) && snapshot.size() >= num_particles;
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!ok && rank == 0) {
+        std::cerr << "could not use snapshot " << snapshot_file << " for " << num_particles << " particles" << std::endl;
+    }
+    return ok;
+}
+
+// Writes the forces of lines [first_line, first_line + forces.size()) with MPI-IO, each rank its own
+// slice at the offset an exclusive scan of the formatted sizes gives it. Past total_lines the lines
+// repeat, as tiling does, up to num_particles. Every rank must call it; false on every rank if any failed.
+bool write_forces_mpi(const std::string& filename, const std::vector<double>& forces, int64_t first_line, int64_t total_lines,
+                      int64_t num_particles, output_format format, int rank) {
+    trace_span span("write output", "gather");
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        if (rank == 0) {
+            std::cerr << "could not write " << filename << std::endl;
         }
-        for (const auto & charge : charges) {
-            results[charge.idx - offset] = (kq1q2 / distance_between_square(charge, all_charges[charge.nearest_neighbor_idx]));
-            // std::cout << "calculating force between x1=" << charge.x << ", y1=" << charge.y 
-            //           << ", x2=" << all_charges[charge.nearest_neighbor_idx].x << ", y2=" << all_charges[charge.nearest_neighbor_idx].y
-            //           << ", force=" << kq1q2 / distance_between_square(charge, all_charges[charge.nearest_neighbor_idx]) << std::endl;
+        return false;
+    }
+    MPI_File_set_size(file, 0);
+    int ok = 1;
+    std::vector<std::vector<char>> blocks;
+    MPI_Offset copy_offset = 0;
+    for (int64_t copy_start = 0; copy_start < num_particles; copy_start += total_lines) {
+        const int64_t first_id = copy_start + first_line;
+        const int64_t count = std::max<int64_t>(0, std::min<int64_t>(forces.size(), num_particles - first_id));
+        format_forces_parallel(forces.data(), count, first_id, format, blocks);
+        long long bytes = 0;
+        for (const auto & block : blocks) {
+            bytes += block.size();
         }
+        long long offset = 0;
+        long long copy_bytes = 0;
+        MPI_Exscan(&bytes, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&bytes, &copy_bytes, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Offset at = copy_offset + (rank == 0 ? 0 : offset);
+        for (const auto & block : blocks) {
+            // MPI counts are ints
+            for (size_t done = 0; done < block.size(); done += 1 << 30) {
+                const int length = std::min<size_t>(block.size() - done, 1 << 30);
+                ok = ok && MPI_File_write_at(file, at, block.data() + done, length, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS;
+                at += length;
+            }
+        }
+        copy_offset += copy_bytes;
+    }
+    ok = (MPI_File_close(&file) == MPI_SUCCESS) && ok;
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!ok && rank == 0) {
+        std::cerr << "could not write " << filename << std::endl;
     }
+    return ok;
 }
 
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: mpirun -np {num_proc} ./build/ForceCalculationMPI {num_threads} {num_particles}" << std::endl;
-        return -1;
+// Ends a run: without output= the forces are gathered on rank 0 as before, otherwise every rank
+// writes its own slice (see write_forces_mpi). Prints and returns (on rank 0) the time to
+// calculate force, which does not include the writing.
+double finish_forces(const output_config& output, const std::vector<double>& local_result, const std::vector<int>& counts,
+                   const std::vector<int>& displs, int64_t num_particles, int rank, int size, double start_time) {
+    const int64_t total = displs[size - 1] + counts[size - 1];
+    if (output.file.empty()) {
+        trace_span gather_span("gather forces", "gather");
+        std::vector<double> line_results(rank == 0 ? total : 0);
+        MPI_Gatherv(local_result.data(), local_result.size(), MPI_DOUBLE, line_results.data(), counts.data(), displs.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        gather_span.end();
     }
-    int rank, size;
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    const double elapsed = MPI_Wtime() - start_time;
+    if (rank == 0) {
+        std::cout << "Time to calculate force: " << elapsed * 1E6 << " microseconds." << std::endl;
+    }
+    if (!output.file.empty()) {
+        start_time = MPI_Wtime();
+        write_forces_mpi(output.file, local_result, displs[rank], total, std::max(num_particles, total), output.format, rank);
+        if (rank == 0) {
+            std::cout << "Time to write output: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        }
+    }
+    return elapsed;
+}
 
-    int blockLengths[4] = {1, 1, 1, 1};
-    MPI_Aint offsets[4] = {
-        offsetof(point_charge, idx),
-        offsetof(point_charge, x),
-        offsetof(point_charge, y),
-        offsetof(point_charge, nearest_neighbor_idx)
-    };
+// All-pairs net force with a ring pass: each rank keeps its own block as targets and forwards a
+// travelling block [count, x..., y..., q...] to its right neighbour, receiving the next one
+// while it computes, so after size steps every rank has seen all particles.
+std::vector<double> ring_all_pairs(const nbody_particles& local, int max_count, int rank, int size, int num_threads) {
+    const int n = local.size();
+    std::vector<double> current(1 + 3 * static_cast<size_t>(max_count), 0.0);
+    std::vector<double> incoming(current.size(), 0.0);
+    current[0] = n;
+    std::copy(local.x.begin(), local.x.end(), current.begin() + 1);
+    std::copy(local.y.begin(), local.y.end(), current.begin() + 1 + max_count);
+    std::copy(local.q.begin(), local.q.end(), current.begin() + 1 + 2 * max_count);
 
-    MPI_Datatype types[4] = {MPI_INT, MPI_INT, MPI_INT, MPI_INT};
-    MPI_Type_create_struct(4, blockLengths, offsets, types, &MPI_POINT_CHARGE);
-    MPI_Type_commit(&MPI_POINT_CHARGE);
+    const nbody_block targets = make_nbody_block(local, 0, n);
+    std::vector<double> fx(n, 0.0), fy(n, 0.0);
+    const int right = (rank + 1) % size;
+    const int left = (rank - 1 + size) % size;
+    for (int step = 0; step < size; step ++) {
+        const bool pass = step < size - 1;
+        MPI_Request requests[2];
+        if (pass) {
+            MPI_Irecv(incoming.data(), incoming.size(), MPI_DOUBLE, left, 0, MPI_COMM_WORLD, &requests[0]);
+            MPI_Isend(current.data(), current.size(), MPI_DOUBLE, right, 0, MPI_COMM_WORLD, &requests[1]);
+        }
+        const double* travelling = current.data() + 1;
+        nbody_block sources = {travelling, travelling + max_count, travelling + 2 * max_count, static_cast<int>(current[0])};
+        accumulate_all_pairs(targets, sources, num_threads, fx.data(), fy.data());
+        if (pass) {
+            MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+            std::swap(current, incoming);
+        }
+    }
 
-    const int num_threads = std::stoi(argv[1]);
-    const int num_particles = std::stoi(argv[2]);
+    std::vector<double> magnitudes(n);
+    for (int i = 0; i < n; i ++) {
+        magnitudes[i] = std::sqrt(fx[i] * fx[i] + fy[i] * fy[i]) * kNetForceScale;
+    }
+    return magnitudes;
+}
 
+// force=allpairs: blocks are scattered (or read from the snapshot) instead of broadcasting
+// everything, then ring_all_pairs runs on them.
+int all_pairs_main(int rank, int size, int num_threads, int num_particles, const std::string& snapshot_file, const output_config& output) {
+    double start_time = MPI_Wtime();
+    trace_span read_span("read file", "read");
+    std::vector<int> counts(size);
+    std::vector<int> displs(size);
+    particle_snapshot snapshot;
     std::vector<point_charge> all_point_charges;
-    int data_size = 0;
-    if (rank == 0) {
-        double start_time = MPI_Wtime();
-        all_point_charges = std::move(setup_point_charges("./particles-student-1.csv", num_particles));
-        double end_time = MPI_Wtime();
-        double total_time = end_time - start_time;
-        std::cout << "Time to read file: " << total_time * 1E6 << " microseconds." << std::endl;
+    int data_size = num_particles;
+    if (!snapshot_file.empty()) {
+        if (!load_snapshot_everywhere(snapshot, snapshot_file, num_particles, rank)) {
+            return -1;
+        }
+    } else if (rank == 0) {
+        all_point_charges = setup_point_charges("./particles-student-1.csv", num_particles, num_threads);
         data_size = all_point_charges.size();
     }
+    MPI_Bcast(&data_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    read_span.end();
+    if (rank == 0) {
+        std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
 
+    int sum = 0;
+    for (int i = 0; i < size; i++) {
+        counts[i] = (i < data_size % size) ? data_size / size + 1 : data_size / size;
+        displs[i] = sum;
+        sum += counts[i];
+    }
 
-    double start_time = 0;
+    trace_span partition_span("partition input", "partition");
+    nbody_particles local;
+    if (!snapshot_file.empty()) {
+        local = nbody_particles(snapshot.columns(), displs[rank], displs[rank] + counts[rank]);
+    } else {
+        std::vector<point_charge> local_data(counts[rank]);
+        MPI_Scatterv(all_point_charges.data(), counts.data(), displs.data(), MPI_POINT_CHARGE, local_data.data(), counts[rank], MPI_POINT_CHARGE, 0, MPI_COMM_WORLD);
+        particle_store store(local_data);
+        local = nbody_particles(store.columns(), 0, store.size());
+    }
+    partition_span.end();
     if (rank == 0) {
+        std::cout << "Time to partition input: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
         start_time = MPI_Wtime();
     }
-    // Broadcast the size of the input to all processes
-    MPI_Bcast(&data_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-    // Resize the vector for all other processes
+    trace_span compute_span("ring all-pairs", "compute");
+    std::vector<double> local_result = ring_all_pairs(local, counts[0], rank, size, num_threads);
+    compute_span.end();
+    double total_time = finish_forces(output, local_result, counts, displs, data_size, rank, size, start_time);
+    if (rank == 0) {
+        std::cout << "Interactions per second: " << static_cast<double>(data_size) * (data_size - 1) / total_time << std::endl;
+    }
+    return 0;
+}
+
+void broadcast_bh_particles(bh_particles& p, int rank) {
+    int header[4] = {static_cast<int>(p.size()), p.min_x, p.min_y, p.side_bits};
+    MPI_Bcast(header, 4, MPI_INT, 0, MPI_COMM_WORLD);
+    const int n = header[0];
     if (rank != 0) {
-        all_point_charges.resize(data_size);
+        p.min_x = header[1];
+        p.min_y = header[2];
+        p.side_bits = header[3];
+        p.x.resize(n);
+        p.y.resize(n);
+        p.q.resize(n);
+        p.index.resize(n);
+        p.code.resize(n);
+    }
+    MPI_Bcast(p.x.data(), n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(p.y.data(), n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(p.q.data(), n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(p.index.data(), n, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(p.code.data(), n, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+}
+
+// force=barneshut: rank 0 sorts the particles along the Morton curve and broadcasts them. The
+// split-level subtrees are dealt out to ranks in contiguous, particle-balanced runs. Each rank
+// builds its own subtrees, the nodes are allgathered so every rank can assemble the top levels,
+// and each rank then evaluates the particles of the subtrees it built.
+int barnes_hut_main(int rank, int size, int num_threads, int num_particles, const std::string& snapshot_file, double theta, int error_samples,
+                    const output_config& output) {
+    double start_time = MPI_Wtime();
+    trace_span read_span("read file", "read");
+    particle_snapshot snapshot;
+    particle_store store;
+    particle_columns columns;
+    if (rank == 0) {
+        if (!snapshot_file.empty() && snapshot.load(snapshot_file) && snapshot.size() >= num_particles) {
+            columns = snapshot.columns();
+            columns.count = num_particles;
+        } else if (snapshot_file.empty()) {
+            store = particle_store(setup_point_charges("./particles-student-1.csv", num_particles, num_threads));
+            columns = store.columns();
+        }
+    }
+    int ok = snapshot_file.empty() || columns.count > 0;
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!ok) {
+        if (rank == 0) {
+            std::cerr << "could not use snapshot " << snapshot_file << " for " << num_particles << " particles" << std::endl;
+        }
+        return -1;
+    }
+
+    bh_particles p;
+    if (rank == 0) {
+        p = morton_sort(columns, num_threads);
+        std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+    read_span.end();
+    trace_span partition_span("broadcast particles", "partition");
+    broadcast_bh_particles(p, rank);
+    const int n = p.size();
+    partition_span.end();
+    if (rank == 0) {
+        std::cout << "Time to partition input: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+
+    // this rank owns the subtrees whose first particle falls in its share of the sorted order
+    trace_span tree_span("build tree", "compute");
+    const int split_level = split_level_for(p);
+    std::vector<std::pair<int, int>> ranges = subtree_ranges(p, split_level);
+    std::vector<std::pair<int, int>> own;
+    for (const auto & range : ranges) {
+        if (static_cast<int64_t>(range.first) * size / std::max(n, 1) == rank) {
+            own.push_back(range);
+        }
+    }
+    std::vector<std::vector<bh_node>> subtrees(own.size());
+    std::atomic<int> next(0);
+    parallel_ranges(num_threads, num_threads, [&](int, int) {
+        for (int s = next.fetch_add(1); s < own.size(); s = next.fetch_add(1)) {
+            build_subtree(p, own[s].first, own[s].second, split_level, subtrees[s]);
+        }
+    });
+    bh_tree local_tree;
+    for (const auto & subtree : subtrees) {
+        append_subtree(local_tree, subtree);
+    }
+
+    int local_nodes = local_tree.nodes.size();
+    std::vector<int> node_counts(size);
+    MPI_Allgather(&local_nodes, 1, MPI_INT, node_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    std::vector<int> byte_counts(size);
+    std::vector<int> byte_displs(size);
+    int node_offset = 0;
+    int total_nodes = 0;
+    for (int r = 0; r < size; r ++) {
+        if (r == rank) node_offset = total_nodes;
+        byte_counts[r] = node_counts[r] * sizeof(bh_node);
+        byte_displs[r] = total_nodes * sizeof(bh_node);
+        total_nodes += node_counts[r];
+    }
+    for (auto & node : local_tree.nodes) {
+        for (int c = 0; c < 4; c ++) {
+            if (node.child[c] >= 0) node.child[c] += node_offset;
+        }
+    }
+    bh_tree tree;
+    tree.nodes.resize(total_nodes);
+    MPI_Allgatherv(local_tree.nodes.data(), byte_counts[rank], MPI_BYTE, tree.nodes.data(), byte_counts.data(), byte_displs.data(), MPI_BYTE, MPI_COMM_WORLD);
+    assemble_top_levels(p, split_level, tree);
+    tree_span.end();
+
+    const int begin = own.empty() ? 0 : own.front().first;
+    const int end = own.empty() ? 0 : own.back().second;
+    trace_span compute_span("walk tree", "compute");
+    std::vector<double> local_result(2 * (end - begin));
+    barnes_hut_range(tree, p, theta, begin, end, num_threads, local_result.data(), local_result.data() + (end - begin));
+    compute_span.end();
+
+    // results come back as [fx..., fy...] per rank, in Morton order
+    trace_span gather_span("gather forces", "gather");
+    int local_count = 2 * (end - begin);
+    std::vector<int> counts(size);
+    std::vector<int> displs(size);
+    MPI_Gather(&local_count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<double> gathered;
+    if (rank == 0) {
+        int sum = 0;
+        for (int r = 0; r < size; r ++) {
+            displs[r] = sum;
+            sum += counts[r];
+        }
+        gathered.resize(sum);
+    }
+    MPI_Gatherv(local_result.data(), local_count, MPI_DOUBLE, gathered.data(), counts.data(), displs.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    gather_span.end();
+
+    std::vector<double> final_results;
+    if (rank == 0) {
+        net_forces forces;
+        forces.fx.resize(n);
+        forces.fy.resize(n);
+        int k = 0;
+        for (int r = 0; r < size; r ++) {
+            const int count = counts[r] / 2;
+            for (int j = 0; j < count; j ++, k ++) {
+                forces.fx[p.index[k]] = gathered[displs[r] + j];
+                forces.fy[p.index[k]] = gathered[displs[r] + count + j];
+            }
+        }
+        final_results = forces.magnitudes();
+        std::cout << "Time to calculate force: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        approximation_error error = sample_force_error(columns, forces, error_samples, num_threads);
+        std::cout << "Barnes-Hut theta=" << theta << " error vs exact on " << error.samples << " samples: max=" << error.max_relative
+                  << ", rms=" << error.rms_relative << std::endl;
+    }
+    // the forces only come back into input order on rank 0, so it writes them all
+    if (!output.file.empty()) {
+        start_time = MPI_Wtime();
+        write_forces_mpi(output.file, final_results, 0, n, n, output.format, rank);
+        if (rank == 0) {
+            std::cout << "Time to write output: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        }
+    }
+    return 0;
+}
+
+// One particle on its way to another rank, shipped as MPI_BYTE.
+struct particle_record {
+    double x;
+    double y;
+    double vx;
+    double vy;
+    double ax;
+    double ay;
+    int32_t id;
+    int32_t polarity;
+};
+
+particle_record make_record(const particle_state& state, int i) {
+    return particle_record{state.x[i], state.y[i], state.vx[i], state.vy[i], state.ax[i], state.ay[i], state.id[i], state.polarity[i]};
+}
+
+void append_record(particle_state& state, const particle_record& r) {
+    const int i = state.size();
+    state.resize(i + 1);
+    state.x[i] = r.x;
+    state.y[i] = r.y;
+    state.vx[i] = r.vx;
+    state.vy[i] = r.vy;
+    state.ax[i] = r.ax;
+    state.ay[i] = r.ay;
+    state.id[i] = r.id;
+    state.polarity[i] = r.polarity;
+}
+
+// Sends outgoing[r] to rank r and returns everything received, ordered by source rank;
+// received_counts[r] is how many records came from rank r.
+template <typename T>
+std::vector<T> exchange_between_ranks(const std::vector<std::vector<T>>& outgoing, std::vector<int>& received_counts) {
+    const int size = outgoing.size();
+    std::vector<int> send_counts(size), send_displs(size), recv_counts(size), recv_displs(size);
+    std::vector<T> send;
+    for (int r = 0; r < size; r ++) {
+        send_displs[r] = send.size() * sizeof(T);
+        send_counts[r] = outgoing[r].size() * sizeof(T);
+        send.insert(send.end(), outgoing[r].begin(), outgoing[r].end());
+    }
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    int total = 0;
+    received_counts.resize(size);
+    for (int r = 0; r < size; r ++) {
+        recv_displs[r] = total;
+        total += recv_counts[r];
+        received_counts[r] = recv_counts[r] / sizeof(T);
+    }
+    std::vector<T> received(total / sizeof(T));
+    MPI_Alltoallv(send.data(), send_counts.data(), send_displs.data(), MPI_BYTE, received.data(), recv_counts.data(), recv_displs.data(), MPI_BYTE, MPI_COMM_WORLD);
+    return received;
+}
+
+// Particles owned by this rank followed by halo copies from the other ranks. Each rank owns the
+// particles whose x lies in its slab [bounds[rank], bounds[rank + 1]); slabs are fixed at
+// start-up so particles change owner as they move.
+struct slab_domain {
+    std::vector<double> bounds;
+    particle_state state;
+    int owned = 0;
+    // halo_send[r]: owned particles rank r holds a copy of, in the order it holds them
+    std::vector<std::vector<int>> halo_send;
+    std::vector<int> halo_counts;
+
+    int slab_of(double x) const {
+        return std::upper_bound(bounds.begin() + 1, bounds.end() - 1, x) - (bounds.begin() + 1);
+    }
+
+    // Drops the halo and ships every owned particle that left the slab to its new owner.
+    void migrate(int rank) {
+        std::vector<std::vector<particle_record>> outgoing(bounds.size() - 1);
+        int kept = 0;
+        for (int i = 0; i < owned; i ++) {
+            const int r = slab_of(state.x[i]);
+            if (r == rank) {
+                copy_particle(i, kept ++);
+            } else {
+                outgoing[r].push_back(make_record(state, i));
+            }
+        }
+        state.resize(kept);
+        std::vector<int> counts;
+        for (const auto & record : exchange_between_ranks(outgoing, counts)) {
+            append_record(state, record);
+        }
+        owned = state.size();
+    }
+
+    // Replaces the halo: rank r gets a copy of every particle within widths[r] of its slab.
+    void build_halo(const std::vector<double>& widths, int rank) {
+        state.resize(owned);
+        std::vector<std::vector<particle_record>> outgoing(bounds.size() - 1);
+        halo_send.assign(bounds.size() - 1, std::vector<int>());
+        const double widest = *std::max_element(widths.begin(), widths.end());
+        for (int i = 0; i < owned; i ++) {
+            const int last = slab_of(state.x[i] + widest);
+            for (int r = slab_of(state.x[i] - widest); r <= last; r ++) {
+                if (r == rank || state.x[i] < bounds[r] - widths[r] || state.x[i] > bounds[r + 1] + widths[r]) continue;
+                outgoing[r].push_back(make_record(state, i));
+                halo_send[r].push_back(i);
+            }
+        }
+        for (const auto & record : exchange_between_ranks(outgoing, halo_counts)) {
+            append_record(state, record);
+        }
+    }
+
+    // Refreshes halo positions after a step that kept the neighbor lists.
+    void update_halo() {
+        std::vector<std::vector<double>> outgoing(halo_send.size());
+        for (int r = 0; r < halo_send.size(); r ++) {
+            for (int i : halo_send[r]) {
+                outgoing[r].push_back(state.x[i]);
+                outgoing[r].push_back(state.y[i]);
+            }
+        }
+        std::vector<int> counts;
+        std::vector<double> received = exchange_between_ranks(outgoing, counts);
+        for (int k = 0; k < received.size() / 2; k ++) {
+            state.x[owned + k] = received[2 * k];
+            state.y[owned + k] = received[2 * k + 1];
+        }
+    }
+
+private:
+    void copy_particle(int from, int to) {
+        state.x[to] = state.x[from];
+        state.y[to] = state.y[from];
+        state.vx[to] = state.vx[from];
+        state.vy[to] = state.vy[from];
+        state.ax[to] = state.ax[from];
+        state.ay[to] = state.ay[from];
+        state.id[to] = state.id[from];
+        state.polarity[to] = state.polarity[from];
+    }
+};
+
+// Migrates, then grows each rank's halo until it holds every particle that rank's neighbor lists
+// can reach: once its widest d_nn + skin fits in the halo, no closer neighbor can be missing
+// either. Widths are per rank so one runaway particle only widens the halo of its own slab.
+void rebuild_domain(slab_domain& domain, verlet_neighbors& neighbors, double skin, std::vector<double>& halo_widths, int rank, int num_threads) {
+    trace_span span("rebuild domain", "partition");
+    domain.migrate(rank);
+    double extent[2] = {HUGE_VAL, HUGE_VAL};
+    for (int i = 0; i < domain.owned; i ++) {
+        extent[0] = std::min(extent[0], domain.state.x[i]);
+        extent[1] = std::min(extent[1], -domain.state.x[i]);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, extent, 2, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    const double full_width = -extent[1] - extent[0] + 1;
+    std::vector<double> reach(halo_widths.size());
+    while (true) {
+        domain.build_halo(halo_widths, rank);
+        neighbors.build(domain.state, domain.owned, skin, num_threads);
+        double local_reach = neighbors.reach();
+        MPI_Allgather(&local_reach, 1, MPI_DOUBLE, reach.data(), 1, MPI_DOUBLE, MPI_COMM_WORLD);
+        bool complete = true;
+        for (int r = 0; r < reach.size(); r ++) {
+            if (reach[r] > halo_widths[r] && halo_widths[r] < full_width) {
+                halo_widths[r] = std::min(reach[r], full_width);
+                complete = false;
+            }
+        }
+        if (complete) {
+            break;
+        }
+    }
+    // the next rebuild starts from what was needed this time
+    for (int r = 0; r < reach.size(); r ++) {
+        halo_widths[r] = std::min(reach[r], full_width);
+    }
+}
+
+// steps=N: velocity-Verlet time stepping on x slabs. Rank 0 reads the particles and picks slab
+// bounds at x quantiles; after that every rank only holds its own particles plus a halo. Particles
+// migrate and the halo is rebuilt whenever the neighbor lists go stale, otherwise only halo
+// positions are exchanged.
+int simulation_main(int rank, int size, int num_threads, int num_particles, const std::string& snapshot_file, const simulation_config& config) {
+    double start_time = MPI_Wtime();
+    slab_domain domain;
+    domain.bounds.assign(size + 1, 0.0);
+    double skin = config.skin;
+    if (rank == 0) {
+        particle_snapshot snapshot;
+        particle_store store;
+        particle_columns columns;
+        if (snapshot_file.empty()) {
+            store = particle_store(setup_point_charges("./particles-student-1.csv", num_particles, num_threads));
+            columns = store.columns();
+        } else if (snapshot.load(snapshot_file) && snapshot.size() >= num_particles) {
+            columns = snapshot.columns();
+            columns.count = num_particles;
+        } else {
+            std::cerr << "could not use snapshot " << snapshot_file << " for " << num_particles << " particles" << std::endl;
+        }
+        domain.state = make_particle_state(columns);
+        domain.owned = domain.state.size();
+        if (skin <= 0) {
+            skin = default_skin(domain.state, domain.owned);
+        }
+        std::vector<double> sorted_x(domain.state.x);
+        for (int r = 1; r < size; r ++) {
+            const size_t k = sorted_x.size() * r / size;
+            std::nth_element(sorted_x.begin(), sorted_x.begin() + k, sorted_x.end());
+            domain.bounds[r] = sorted_x.empty() ? 0 : sorted_x[k];
+        }
+        std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+    int total = domain.owned;
+    MPI_Bcast(&total, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (total < 2) {
+        return -1;
+    }
+    MPI_Bcast(&skin, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(domain.bounds.data(), size + 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    domain.bounds[0] = -HUGE_VAL;
+    domain.bounds[size] = HUGE_VAL;
+
+    verlet_neighbors neighbors;
+    std::vector<double> halo_widths(size, 4 * skin);
+    rebuild_domain(domain, neighbors, skin, halo_widths, rank, num_threads);
+    nearest_accelerations(domain.state, domain.owned, neighbors, config.mass, config.grain);
+    if (rank == 0) {
+        std::cout << "Time to partition input: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+
+    int rebuilds = 0;
+    for (int step = 1; step <= config.steps; step ++) {
+        half_kick(domain.state, domain.owned, config.dt, config.grain);
+        drift(domain.state, domain.owned, config.dt, config.grain);
+        trace_span wait_span("agree on displacement", "queue wait");
+        double displacement = neighbors.max_displacement(domain.state, num_threads);
+        MPI_Allreduce(MPI_IN_PLACE, &displacement, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        wait_span.end();
+        if (neighbors.stale(displacement)) {
+            rebuild_domain(domain, neighbors, skin, halo_widths, rank, num_threads);
+            rebuilds ++;
+        } else {
+            trace_span span("update halo", "gather");
+            domain.update_halo();
+        }
+        nearest_accelerations(domain.state, domain.owned, neighbors, config.mass, config.grain);
+        half_kick(domain.state, domain.owned, config.dt, config.grain);
+        if (config.checkpoint_every > 0 && step % config.checkpoint_every == 0) {
+            write_checkpoint(checkpoint_name(config.checkpoint_prefix, step, rank), domain.state, domain.owned);
+        }
+    }
+
+    int owned_range[2] = {domain.owned, -domain.owned};
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : owned_range, owned_range, 2, MPI_INT, MPI_MIN, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        double seconds = std::max(MPI_Wtime() - start_time, 1E-6);
+        std::cout << "Time to simulate " << config.steps << " steps: " << seconds * 1E6 << " microseconds." << std::endl;
+        std::cout << "Simulated " << config.steps << " steps with " << rebuilds << " neighbor list rebuilds: " << config.steps / seconds
+                  << " steps per second, " << static_cast<double>(config.steps) * total / seconds << " particle-steps per second." << std::endl;
+        std::cout << "Particles per rank: min=" << owned_range[0] << ", max=" << -owned_range[1] << std::endl;
+    }
+    return 0;
+}
+
+// Contiguous run of input lines held by one rank. first_lines[r] is the first line of rank r's
+// block and first_lines[size] the number of lines used; idx holds the line number.
+struct line_block {
+    std::vector<point_charge> lines;
+    std::vector<int> first_lines;
+
+    int first_line(int rank) const { return first_lines[rank]; }
+    int total() const { return first_lines.back(); }
+
+    int owner_of(int line) const {
+        return std::upper_bound(first_lines.begin(), first_lines.end() - 1, line) - first_lines.begin() - 1;
+    }
+};
+
+void number_lines(line_block& block, int rank, int size) {
+    int count = block.lines.size();
+    std::vector<int> counts(size);
+    MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    block.first_lines.assign(size + 1, 0);
+    for (int r = 0; r < size; r ++) {
+        block.first_lines[r + 1] = block.first_lines[r] + counts[r];
     }
+    for (int k = 0; k < count; k ++) {
+        block.lines[k].idx = block.first_lines[rank] + k;
+    }
+}
 
-    // Broadcast all point charges for read, so they don't need file IO
-    MPI_Bcast(&all_point_charges[0], data_size, MPI_POINT_CHARGE, 0, MPI_COMM_WORLD);
+// Average bytes per line over the first 64KB of filename, or 0 if it cannot be read.
+double head_line_bytes(const std::string& filename) {
+    std::vector<char> head(1 << 16);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t got = pread(fd, head.data(), head.size(), 0);
+    close(fd);
+    const int lines = got > 0 ? std::count(head.begin(), head.begin() + got, '\n') : 0;
+    return lines > 0 ? static_cast<double>(got) / lines : 0;
+}
 
-    std::vector<int> sendcounts(size);
+// read=parallel: every rank parses its own newline-aligned byte range of the file, so no rank ever
+// holds more than its share, and none parses more than num_particles lines. A rank whose range
+// starts, going by the line length of the file's head, well past line num_particles skips parsing;
+// should the exact counts of the ranks before it (MPI_Exscan) say otherwise, it parses in a second
+// pass. Lines past num_particles are dropped, as the serial reader does.
+line_block read_own_lines(const std::string& filename, int num_particles, int rank, int size, int num_threads) {
+    struct stat st;
+    const off_t bytes = stat(filename.c_str(), &st) == 0 ? st.st_size : 0;
+    const off_t begin_byte = bytes * rank / size;
+    const off_t end_byte = bytes * (rank + 1) / size;
+    const double line_bytes = head_line_bytes(filename);
+    line_block block;
+    bool parsed = false;
+    if (line_bytes <= 0 || begin_byte < 2.0 * num_particles * line_bytes) {
+        block.lines = read_point_charges(filename, num_particles, num_threads, begin_byte, end_byte);
+        parsed = true;
+    }
+    while (true) {
+        int64_t count = block.lines.size();
+        int64_t before = 0;
+        MPI_Exscan(&count, &before, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+        if (rank == 0) {
+            before = 0;
+        }
+        // before only counts ranks that parsed, so it can only grow towards the exact value
+        int missing = !parsed && before < num_particles;
+        MPI_Allreduce(MPI_IN_PLACE, &missing, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+        if (!missing) {
+            break;
+        }
+        if (!parsed && before < num_particles) {
+            block.lines = read_point_charges(filename, num_particles - before, num_threads, begin_byte, end_byte);
+        }
+        parsed = true;
+    }
+    number_lines(block, rank, size);
+    if (block.total() > num_particles) {
+        block.lines.resize(std::max(0, std::min<int>(block.lines.size(), num_particles - block.first_line(rank))));
+        number_lines(block, rank, size);
+    }
+    return block;
+}
+
+// Default: rank 0 reads the file and scatters even blocks of lines.
+line_block scatter_lines(const std::string& filename, int num_particles, int rank, int size, int num_threads) {
+    std::vector<point_charge> all_lines;
+    int total = 0;
+    if (rank == 0) {
+        all_lines = read_point_charges(filename, num_particles, num_threads);
+        total = all_lines.size();
+    }
+    MPI_Bcast(&total, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<int> counts(size);
     std::vector<int> displs(size);
     int sum = 0;
     for (int i = 0; i < size; i++) {
-        sendcounts[i] = (i < data_size % size) ? data_size / size + 1 : data_size / size;
+        counts[i] = (i < total % size) ? total / size + 1 : total / size;
         displs[i] = sum;
-        sum += sendcounts[i];
+        sum += counts[i];
+    }
+    line_block block;
+    block.lines.resize(counts[rank]);
+    MPI_Scatterv(all_lines.data(), counts.data(), displs.data(), MPI_POINT_CHARGE, block.lines.data(), counts[rank], MPI_POINT_CHARGE, 0, MPI_COMM_WORLD);
+    number_lines(block, rank, size);
+    return block;
+}
+
+// Particles whose force this rank computes, with nearest_neighbor_idx set to the neighbor's line,
+// plus halo copies of every neighbor it does not own.
+struct nearest_problem {
+    std::vector<point_charge> owned;
+    std::vector<point_charge> halo;
+};
+
+// neighbors=adjacent: a block only needs the line just before and just after it.
+nearest_problem adjacent_problem(const line_block& block, int rank, int size) {
+    nearest_problem problem;
+    problem.owned = block.lines;
+    point_charge ends[2] = {};
+    if (!block.lines.empty()) {
+        ends[0] = block.lines.front();
+        ends[1] = block.lines.back();
+    }
+    std::vector<point_charge> all_ends(2 * size);
+    MPI_Allgather(ends, 2, MPI_POINT_CHARGE, all_ends.data(), 2, MPI_POINT_CHARGE, MPI_COMM_WORLD);
+    const int first = block.first_line(rank);
+    const int count = block.lines.size();
+    for (int r = 0; r < size; r ++) {
+        if (r == rank || block.first_lines[r + 1] == block.first_lines[r]) continue;
+        if (all_ends[2 * r + 1].idx == first - 1) problem.halo.push_back(all_ends[2 * r + 1]);
+        if (all_ends[2 * r].idx == first + count) problem.halo.push_back(all_ends[2 * r]);
     }
 
-    int adjusted_chunk_size = sendcounts[rank];
-    std::vector<point_charge> local_data(adjusted_chunk_size);
+    // same choice as assign_adjacent_neighbors
+    auto line = [&](int l) -> const point_charge& {
+        if (l >= first && l < first + count) return block.lines[l - first];
+        return problem.halo[problem.halo[0].idx == l ? 0 : 1];
+    };
+    const int total = block.total();
+    for (int k = 0; k < count; k ++) {
+        const int l = first + k;
+        if (l == total - 1) {
+            problem.owned[k].nearest_neighbor_idx = total - 2;
+        } else if (l == 0) {
+            problem.owned[k].nearest_neighbor_idx = 1;
+        } else {
+            double prev_distance = distance_between_square(line(l), line(l - 1));
+            double next_distance = distance_between_square(line(l), line(l + 1));
+            problem.owned[k].nearest_neighbor_idx = prev_distance < next_distance ? l - 1 : l + 1;
+        }
+    }
+    return problem;
+}
+
+// neighbors=grid: particles move to x slabs cut at quantiles of a sample of all x. Each slab's halo
+// is widened until its widest nearest-neighbor distance fits inside, at which point no closer
+// particle can be missing and the local grid search is exact.
+nearest_problem grid_problem(const line_block& block, int rank, int size, int num_threads) {
+    const int count = block.lines.size();
+    const int samples = std::min(count, 256);
+    std::vector<int> sample(samples);
+    for (int k = 0; k < samples; k ++) {
+        sample[k] = block.lines[static_cast<int64_t>(k) * count / samples].x;
+    }
+    std::vector<int> sample_counts(size);
+    std::vector<int> sample_displs(size, 0);
+    MPI_Allgather(&samples, 1, MPI_INT, sample_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 1; r < size; r ++) {
+        sample_displs[r] = sample_displs[r - 1] + sample_counts[r - 1];
+    }
+    std::vector<int> all_samples(sample_displs[size - 1] + sample_counts[size - 1]);
+    MPI_Allgatherv(sample.data(), samples, MPI_INT, all_samples.data(), sample_counts.data(), sample_displs.data(), MPI_INT, MPI_COMM_WORLD);
+    std::sort(all_samples.begin(), all_samples.end());
+    std::vector<int64_t> bounds(size + 1);
+    bounds[0] = INT64_MIN;
+    bounds[size] = INT64_MAX;
+    for (int r = 1; r < size; r ++) {
+        bounds[r] = all_samples.empty() ? 0 : all_samples[all_samples.size() * r / size];
+    }
+    auto slab_of = [&](int64_t x) {
+        return static_cast<int>(std::upper_bound(bounds.begin() + 1, bounds.end() - 1, x) - (bounds.begin() + 1));
+    };
+
+    std::vector<std::vector<point_charge>> outgoing(size);
+    for (const auto & charge : block.lines) {
+        outgoing[slab_of(charge.x)].push_back(charge);
+    }
+    std::vector<int> received;
+    nearest_problem problem;
+    problem.owned = exchange_between_ranks(outgoing, received);
+
+    int64_t extent[4] = {INT_MAX, INT_MAX, INT_MAX, INT_MAX};
+    for (const auto & charge : problem.owned) {
+        extent[0] = std::min<int64_t>(extent[0], charge.x);
+        extent[1] = std::min<int64_t>(extent[1], -charge.x);
+        extent[2] = std::min<int64_t>(extent[2], charge.y);
+        extent[3] = std::min<int64_t>(extent[3], -charge.y);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, extent, 4, MPI_INT64_T, MPI_MIN, MPI_COMM_WORLD);
+    const double full_width = static_cast<double>(-extent[1] - extent[0] + 1);
+    const double area = full_width * static_cast<double>(-extent[3] - extent[2] + 1);
+    std::vector<double> widths(size, 4 * std::sqrt(area / std::max(block.total(), 1)));
+    std::vector<double> reach(size);
+
+    while (true) {
+        for (auto & out : outgoing) out.clear();
+        const double widest = *std::max_element(widths.begin(), widths.end());
+        for (const auto & charge : problem.owned) {
+            const int last = slab_of(charge.x + static_cast<int64_t>(std::ceil(widest)));
+            for (int r = slab_of(charge.x - static_cast<int64_t>(std::ceil(widest))); r <= last; r ++) {
+                if (r == rank || charge.x < bounds[r] - widths[r] || charge.x > bounds[r + 1] + widths[r]) continue;
+                outgoing[r].push_back(charge);
+            }
+        }
+        problem.halo = exchange_between_ranks(outgoing, received);
+
+        // search in line order so ties go to the lower line, as in the serial search
+        const int owned = problem.owned.size();
+        const int local = owned + problem.halo.size();
+        auto at = [&](int k) -> const point_charge& { return k < owned ? problem.owned[k] : problem.halo[k - owned]; };
+        std::vector<int> order(local);
+        for (int k = 0; k < local; k ++) order[k] = k;
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return at(a).idx < at(b).idx; });
+        std::vector<int32_t> xs(local), ys(local);
+        std::vector<int> position(local);
+        for (int s = 0; s < local; s ++) {
+            xs[s] = at(order[s]).x;
+            ys[s] = at(order[s]).y;
+            position[order[s]] = s;
+        }
+        spatial_grid grid;
+        grid.build(xs.data(), ys.data(), local, num_threads);
+        double local_reach = 0;
+        for (int k = 0; k < owned; k ++) {
+            const int s = position[k];
+            const int nearest = grid.nearest(xs[s], ys[s], s);
+            if (nearest < 0) {
+                local_reach = HUGE_VAL;
+                continue;
+            }
+            problem.owned[k].nearest_neighbor_idx = at(order[nearest]).idx;
+            const double dx = static_cast<double>(xs[nearest]) - xs[s];
+            const double dy = static_cast<double>(ys[nearest]) - ys[s];
+            local_reach = std::max(local_reach, std::sqrt(dx * dx + dy * dy));
+        }
 
-    MPI_Scatterv(&all_point_charges[0], sendcounts.data(), displs.data(), MPI_POINT_CHARGE, &local_data[0], sendcounts[rank], MPI_POINT_CHARGE, 0, MPI_COMM_WORLD);
-    
+        MPI_Allgather(&local_reach, 1, MPI_DOUBLE, reach.data(), 1, MPI_DOUBLE, MPI_COMM_WORLD);
+        bool complete = true;
+        for (int r = 0; r < size; r ++) {
+            if (reach[r] > widths[r] && widths[r] < full_width) {
+                widths[r] = std::min(reach[r], full_width);
+                complete = false;
+            }
+        }
+        if (complete) {
+            return problem;
+        }
+    }
+}
+
+// Nearest-neighbor force on every owned particle; neighbors are looked up by line in owned and halo.
+std::vector<double> local_nearest_forces(const nearest_problem& problem, int grain) {
+    std::vector<point_charge> local(problem.owned);
+    local.insert(local.end(), problem.halo.begin(), problem.halo.end());
+    std::vector<std::pair<int, int>> by_line(local.size());
+    for (int k = 0; k < local.size(); k ++) {
+        by_line[k] = std::make_pair(local[k].idx, k);
+    }
+    std::sort(by_line.begin(), by_line.end());
+    for (int k = 0; k < problem.owned.size(); k ++) {
+        auto it = std::lower_bound(by_line.begin(), by_line.end(), std::make_pair(local[k].nearest_neighbor_idx, INT_MIN));
+        local[k].nearest_neighbor_idx = it->second;
+    }
+    particle_store store(local);
+    std::vector<double> forces(problem.owned.size());
+    compute_slice(store.columns(), 0, problem.owned.size(), grain, forces);
+    return forces;
+}
+
+// Sends each force back to the rank whose block holds that line.
+std::vector<double> return_to_blocks(const nearest_problem& problem, const std::vector<double>& forces, const line_block& block, int rank, int size) {
+    std::vector<std::vector<std::pair<int, double>>> outgoing(size);
+    for (int k = 0; k < problem.owned.size(); k ++) {
+        outgoing[block.owner_of(problem.owned[k].idx)].push_back(std::make_pair(problem.owned[k].idx, forces[k]));
+    }
+    std::vector<int> received;
+    std::vector<double> block_forces(block.lines.size());
+    for (const auto & line_force : exchange_between_ranks(outgoing, received)) {
+        block_forces[line_force.first - block.first_line(rank)] = line_force.second;
+    }
+    return block_forces;
+}
+
+// force=nearest without a snapshot. Each rank holds a block of about n/p lines and, for the
+// force, only the particles it owns plus the halo its nearest neighbors need; nothing is broadcast.
+// Forces of tiled copies (num_particles beyond the file) repeat the forces of their lines.
+int nearest_main(int rank, int size, int num_threads, int num_particles, neighbor_mode neighbors, bool parallel_read, int grain, const output_config& output) {
+    double start_time = MPI_Wtime();
+    trace_span read_span("read file", "read");
+    line_block block = parallel_read ? read_own_lines("./particles-student-1.csv", num_particles, rank, size, num_threads)
+                                     : scatter_lines("./particles-student-1.csv", num_particles, rank, size, num_threads);
+    const int total = block.total();
+    if (total < 2) {
+        if (rank == 0) {
+            std::cerr << "too few points!" << std::endl;
+        }
+        return -1;
+    }
+    read_span.end();
+    if (rank == 0) {
+        std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+
+    trace_span partition_span("partition input", "partition");
+    nearest_problem problem = (neighbors == neighbor_mode::grid) ? grid_problem(block, rank, size, num_threads) : adjacent_problem(block, rank, size);
+    partition_span.end();
     if (rank == 0) {
-        double end_time = MPI_Wtime();
-        double total_time = end_time - start_time;
-        std::cout << "Time to partition input: " << total_time * 1E6 << " microseconds." << std::endl;
+        std::cout << "Time to partition input: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
         start_time = MPI_Wtime();
     }
 
-    std::vector<double> local_result(adjusted_chunk_size, -1);
-    std::queue<std::vector<point_charge>> worker_queue;
-    int thread_chunk_size = adjusted_chunk_size / num_threads;
-    for (int i = 0; i < num_threads; i ++) {
-        int start = i * thread_chunk_size;
-        int end = (i == num_threads - 1) ? adjusted_chunk_size : start + thread_chunk_size;
-        // std::cout << "Rank=" << rank << ", thread #" << i << ", start=" << start << ", end=" << end << ", start_idx=" << (local_data.begin() + start)->idx << ", end_idx=" << (local_data.begin() + end)->idx << std::endl;
-        worker_queue.push(std::vector<point_charge>(local_data.begin() + start, local_data.begin() + end));
+    trace_span compute_span("nearest forces", "compute");
+    std::vector<double> local_result = local_nearest_forces(problem, grain);
+    compute_span.end();
+    if (neighbors == neighbor_mode::grid) {
+        trace_span return_span("return to blocks", "gather");
+        local_result = return_to_blocks(problem, local_result, block, rank, size);
     }
 
-    std::vector<std::future<void>> futures;
-    for (int i = 0; i < num_threads; i ++) {
-        futures.push_back(std::async(std::launch::async, thread_worker, std::ref(worker_queue), std::cref(all_point_charges), std::ref(local_result), local_data.begin()->idx));
+    std::vector<int> counts(size);
+    for (int r = 0; r < size; r ++) {
+        counts[r] = block.first_lines[r + 1] - block.first_lines[r];
     }
+    finish_forces(output, local_result, counts, block.first_lines, num_particles, rank, size, start_time);
+    return 0;
+}
 
-    for (auto & f : futures) {
-        f.get();
+// One particle together with its nearest neighbor, so a streamed chunk can be computed on its own.
+struct neighbor_pair {
+    int32_t x;
+    int32_t y;
+    int32_t polarity;
+    int32_t neighbor_x;
+    int32_t neighbor_y;
+    int32_t neighbor_polarity;
+};
+
+// Rank 0's side of pipeline=: turns the input into chunks of neighbor pairs, one chunk at a time.
+// With adjacent neighbors only the chunk starts are found up front (a newline scan) and each chunk
+// is parsed when it is requested; grid neighbors need every particle first, so the file is read whole.
+class chunk_source {
+public:
+    ~chunk_source() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), bytes_);
+        }
     }
 
-    std::vector<double> final_results;
+    bool open(const std::string& filename, int num_particles, int chunk_lines, neighbor_mode neighbors, int num_threads) {
+        chunk_lines_ = chunk_lines;
+        num_threads_ = num_threads;
+        if (neighbors == neighbor_mode::grid) {
+            lines_ = read_point_charges(filename, num_particles, num_threads);
+            total_ = lines_.size();
+            if (total_ >= 2) {
+                assign_grid_neighbors(lines_, num_threads);
+            }
+            whole_ = true;
+            return true;
+        }
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data_ = static_cast<const char*>(mapped);
+                bytes_ = st.st_size;
+                madvise(mapped, bytes_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        if (!data_) {
+            return false;
+        }
+        const char* p = data_;
+        const char* end = data_ + bytes_;
+        while (p < end && total_ < num_particles) {
+            if (total_ % chunk_lines_ == 0) {
+                starts_.push_back(p);
+            }
+            p = next_line_start(p, end);
+            total_ ++;
+        }
+        starts_.push_back(p);
+        return true;
+    }
+
+    int total() const { return total_; }
+
+    // Chunks must be filled in order.
+    void fill(int chunk, std::vector<neighbor_pair>& pairs) {
+        const int first = chunk * chunk_lines_;
+        const int count = std::min(chunk_lines_, total_ - first);
+        if (!whole_) {
+            previous_ = chunk > 0 ? lines_.back() : point_charge();
+            parse_point_charges(starts_[chunk], starts_[chunk + 1], count, num_threads_, lines_);
+            if (first + count < total_) {
+                parse_point_charge_line(starts_[chunk + 1], data_ + bytes_, next_);
+            }
+        }
+        const int offset = whole_ ? 0 : first;
+        // same choice as assign_adjacent_neighbors
+        auto line = [&](int l) -> const point_charge& {
+            if (whole_ || (l >= first && l < first + count)) return lines_[l - offset];
+            return l < first ? previous_ : next_;
+        };
+        pairs.resize(count);
+        for (int k = 0; k < count; k ++) {
+            const int l = first + k;
+            int neighbor;
+            if (whole_) {
+                neighbor = lines_[l].nearest_neighbor_idx;
+            } else if (l == total_ - 1) {
+                neighbor = total_ - 2;
+            } else if (l == 0) {
+                neighbor = 1;
+            } else {
+                neighbor = distance_between_square(line(l), line(l - 1)) < distance_between_square(line(l), line(l + 1)) ? l - 1 : l + 1;
+            }
+            const point_charge& self = line(l);
+            const point_charge& other = line(neighbor);
+            pairs[k] = neighbor_pair{self.x, self.y, self.polarity, other.x, other.y, other.polarity};
+        }
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t bytes_ = 0;
+    std::vector<const char*> starts_;
+    std::vector<point_charge> lines_;
+    point_charge previous_ = point_charge();
+    point_charge next_ = point_charge();
+    int chunk_lines_ = 1;
+    int num_threads_ = 1;
+    int total_ = 0;
+    bool whole_ = false;
+};
+
+// Forces of a chunk of pairs. The chunk is done in a few slices with an MPI_Testall on the other
+// chunks' requests in between, so their transfers keep progressing while the pool computes.
+void compute_pairs(const std::vector<neighbor_pair>& pairs, std::vector<double>& out, MPI_Request* pending, int pending_count, int grain) {
+    const int count = pairs.size();
+    particle_store store;
+    store.x.resize(2 * count);
+    store.y.resize(2 * count);
+    store.polarity.resize(2 * count);
+    store.nearest_neighbor_idx.resize(2 * count);
+    for (int k = 0; k < count; k ++) {
+        store.x[k] = pairs[k].x;
+        store.y[k] = pairs[k].y;
+        store.polarity[k] = pairs[k].polarity;
+        store.nearest_neighbor_idx[k] = count + k;
+        store.x[count + k] = pairs[k].neighbor_x;
+        store.y[count + k] = pairs[k].neighbor_y;
+        store.polarity[count + k] = pairs[k].neighbor_polarity;
+        store.nearest_neighbor_idx[count + k] = k;
+    }
+    const particle_columns columns = store.columns();
+    nearest_force_kernel kernel = default_nearest_force_kernel();
+    out.resize(count);
+    const int slices = 4;
+    for (int s = 0; s < slices; s ++) {
+        thread_pool::global().parallel_for(count * s / slices, count * (s + 1) / slices, grain, [&](int start, int stop) {
+            kernel(columns, start, stop, out.data() + start);
+        });
+        int done;
+        MPI_Testall(pending_count, pending, &done, MPI_STATUSES_IGNORE);
+    }
+}
+
+// pipeline={lines}: rank 0 streams the input in chunks of that many lines with MPI_Iscatterv while
+// every rank computes the chunk it already has and returns the one before with MPI_Igatherv.
+// Buffers alternate between two slots, so chunk c + 1 is in flight while c is computed and c - 1
+// is being gathered. Ends with a per-rank breakdown of where the time went.
+int pipelined_nearest_main(int rank, int size, int num_threads, int num_particles, neighbor_mode neighbors, int chunk_lines, int grain,
+                           const output_config& output) {
+    double start_time = MPI_Wtime();
+    MPI_Datatype MPI_NEIGHBOR_PAIR;
+    MPI_Type_contiguous(6, MPI_INT, &MPI_NEIGHBOR_PAIR);
+    MPI_Type_commit(&MPI_NEIGHBOR_PAIR);
+
+    chunk_source source;
+    int total = 0;
+    if (rank == 0 && source.open("./particles-student-1.csv", num_particles, chunk_lines, neighbors, num_threads)) {
+        total = source.total();
+    }
+    MPI_Bcast(&total, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (total < 2) {
+        if (rank == 0) {
+            std::cerr << "too few points!" << std::endl;
+        }
+        MPI_Type_free(&MPI_NEIGHBOR_PAIR);
+        return -1;
+    }
+    if (rank == 0) {
+        std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        start_time = MPI_Wtime();
+    }
+
+    // even split of every chunk over the ranks; gather_displs place it in the line order
+    const int chunks = (total + chunk_lines - 1) / chunk_lines;
+    std::vector<std::vector<int>> counts(chunks, std::vector<int>(size));
+    std::vector<std::vector<int>> displs(chunks, std::vector<int>(size));
+    std::vector<std::vector<int>> gather_displs(chunks, std::vector<int>(size));
+    for (int c = 0; c < chunks; c ++) {
+        const int count = std::min(chunk_lines, total - c * chunk_lines);
+        int sum = 0;
+        for (int r = 0; r < size; r ++) {
+            counts[c][r] = (r < count % size) ? count / size + 1 : count / size;
+            displs[c][r] = sum;
+            gather_displs[c][r] = c * chunk_lines + sum;
+            sum += counts[c][r];
+        }
+    }
+
+    std::vector<neighbor_pair> send[2];
+    std::vector<neighbor_pair> received[2];
+    std::vector<double> results[2];
+    MPI_Request scatter_requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    MPI_Request gather_requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    std::vector<double> line_results;
+    if (rank == 0) {
+        line_results.resize(total);
+    }
+    // parse, wait for input, compute, wait for results
+    double phases[4] = {0, 0, 0, 0};
+
+    auto post_scatter = [&](int c) {
+        const int slot = c % 2;
+        if (rank == 0) {
+            trace_span span("parse chunk", "read");
+            double t = MPI_Wtime();
+            source.fill(c, send[slot]);
+            phases[0] += MPI_Wtime() - t;
+        }
+        received[slot].resize(counts[c][rank]);
+        MPI_Iscatterv(send[slot].data(), counts[c].data(), displs[c].data(), MPI_NEIGHBOR_PAIR, received[slot].data(), counts[c][rank],
+                      MPI_NEIGHBOR_PAIR, 0, MPI_COMM_WORLD, &scatter_requests[slot]);
+    };
+
+    post_scatter(0);
+    for (int c = 0; c < chunks; c ++) {
+        const int slot = c % 2;
+        const int other = 1 - slot;
+        if (c + 1 < chunks) {
+            post_scatter(c + 1);
+        }
+        trace_span input_span("wait for input", "queue wait");
+        double t = MPI_Wtime();
+        MPI_Wait(&scatter_requests[slot], MPI_STATUS_IGNORE);
+        phases[1] += MPI_Wtime() - t;
+        input_span.end();
+        // chunk c - 2 was gathered from this slot
+        trace_span results_span("wait for results", "gather");
+        t = MPI_Wtime();
+        MPI_Wait(&gather_requests[slot], MPI_STATUS_IGNORE);
+        phases[3] += MPI_Wtime() - t;
+        results_span.end();
+
+        trace_span compute_span("compute chunk", "compute");
+        t = MPI_Wtime();
+        MPI_Request pending[2] = {scatter_requests[other], gather_requests[other]};
+        compute_pairs(received[slot], results[slot], pending, 2, grain);
+        scatter_requests[other] = pending[0];
+        gather_requests[other] = pending[1];
+        phases[2] += MPI_Wtime() - t;
+        compute_span.end();
+
+        MPI_Igatherv(results[slot].data(), counts[c][rank], MPI_DOUBLE, line_results.data(), counts[c].data(), gather_displs[c].data(),
+                     MPI_DOUBLE, 0, MPI_COMM_WORLD, &gather_requests[slot]);
+    }
+    trace_span results_span("wait for results", "gather");
+    double t = MPI_Wtime();
+    MPI_Waitall(2, gather_requests, MPI_STATUSES_IGNORE);
+    phases[3] += MPI_Wtime() - t;
+    results_span.end();
+    const double elapsed = MPI_Wtime() - start_time;
+
+    std::vector<double> all_phases(rank == 0 ? 4 * size : 0);
+    MPI_Gather(phases, 4, MPI_DOUBLE, all_phases.data(), 4, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     if (rank == 0) {
-        final_results.resize(all_point_charges.size());
+        std::cout << "Time to partition input and calculate force in " << chunks << " chunks: " << elapsed * 1E6 << " microseconds." << std::endl;
+        for (int r = 0; r < size; r ++) {
+            const double* p = all_phases.data() + 4 * r;
+            std::cout << "Rank " << r << ": parse " << p[0] * 1E6 << ", wait for input " << p[1] * 1E6 << ", compute " << p[2] * 1E6
+                      << ", wait for results " << p[3] * 1E6 << " microseconds." << std::endl;
+        }
+    }
+    // the chunks were gathered on rank 0 anyway, so it writes them all
+    if (!output.file.empty()) {
+        start_time = MPI_Wtime();
+        write_forces_mpi(output.file, line_results, 0, total, std::max(num_particles, total), output.format, rank);
+        if (rank == 0) {
+            std::cout << "Time to write output: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+        }
     }
-    // MPI_Gather(&local_result[0], adjusted_chunk_size, MPI_DOUBLE, &final_results[0], adjusted_chunk_size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    // MPI_Gatherv(&local_result[0], adjusted_chunk_size, MPI_DOUBLE, &final_results[0], sendcounts.data(), displs.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Gatherv(local_result.data(), local_result.size(), MPI_DOUBLE, final_results.data(), sendcounts.data(), displs.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&MPI_NEIGHBOR_PAIR);
+    return 0;
+}
 
+// Gathers every rank's trace events into trace_file on rank 0 (one trace process per rank).
+void write_trace_everywhere(const std::string& trace_file, int rank, int size) {
+    tracer::instance().stop();
+    char host[MPI_MAX_PROCESSOR_NAME];
+    int host_length = 0;
+    MPI_Get_processor_name(host, &host_length);
+    const std::string events = tracer::instance().events_json(rank, "rank " + std::to_string(rank) + " on " + std::string(host, host_length));
+    int length = events.size();
+    std::vector<int> lengths(size);
+    MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<int> displs(size, 0);
+    std::string all;
+    if (rank == 0) {
+        for (int r = 1; r < size; r ++) {
+            displs[r] = displs[r - 1] + lengths[r - 1];
+        }
+        all.resize(displs[size - 1] + lengths[size - 1]);
+    }
+    MPI_Gatherv(events.data(), length, MPI_CHAR, &all[0], lengths.data(), displs.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
     if (rank == 0) {
-        // print_force(final_results);
-        double end_time = MPI_Wtime();
-        double total_time = end_time - start_time;
-        std::cout << "Time to calculate force: " << total_time * 1E6 << " microseconds." << std::endl;
+        std::string joined;
+        for (int r = 0; r < size; r ++) {
+            joined += (r ? ",\n" : "") + all.substr(displs[r], lengths[r]);
+        }
+        tracer::write(trace_file, joined);
     }
+}
 
+// Common exit path: writes the trace if one was asked for and shuts MPI down.
+int finish(int status, const std::string& trace_file, int rank, int size) {
+    if (!trace_file.empty()) {
+        write_trace_everywhere(trace_file, rank, size);
+    }
     MPI_Type_free(&MPI_POINT_CHARGE);
     MPI_Finalize();
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
+
+int main(int argc, char** argv) {
+    bool valid_args = argc >= 3;
+    for (int i = 3; i < argc; i ++) {
+        valid_args = valid_args && std::string(argv[i]).find('=') != std::string::npos;
+    }
+    valid_args = valid_args && valid_choice(argc, argv, "read", {"root", "parallel"}) && valid_choice(argc, argv, "neighbors", {"adjacent", "grid"})
+        && valid_choice(argc, argv, "force", {"nearest", "allpairs", "barneshut"}) && valid_choice(argc, argv, "format", {"text", "csv", "binary"});
+    if (!valid_args) {
+        std::cerr << "Usage: mpirun -np {num_proc} ./build/ForceCalculationMPI {num_threads} {num_particles} [snapshot={file}] [read={root,parallel}] [pipeline={lines}] [neighbors={adjacent,grid}] [force={nearest,allpairs,barneshut}] [theta={f}] [error_samples={d+}] [grain={d+}] [pin_threads={0,1}] [steps={d+}] [dt={f}] [mass={f}] [skin={f}] [checkpoint_every={d+}] [checkpoint_prefix={path}] [output={file}] [format={text,csv,binary}] [trace={file}] [trace_counters={0,1}]" << std::endl;
+        return -1;
+    }
+    int rank, size;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    int blockLengths[5] = {1, 1, 1, 1, 1};
+    MPI_Aint offsets[5] = {
+        offsetof(point_charge, idx),
+        offsetof(point_charge, x),
+        offsetof(point_charge, y),
+        offsetof(point_charge, nearest_neighbor_idx),
+        offsetof(point_charge, polarity)
+    };
+
+    MPI_Datatype types[5] = {MPI_INT, MPI_INT, MPI_INT, MPI_INT, MPI_INT};
+    MPI_Type_create_struct(5, blockLengths, offsets, types, &MPI_POINT_CHARGE);
+    MPI_Type_commit(&MPI_POINT_CHARGE);
+
+    const int num_threads = std::stoi(argv[1]);
+    const int num_particles = std::stoi(argv[2]);
+    const std::string snapshot_file = find_arg(argc, argv, "snapshot");
+    const neighbor_mode neighbors = parse_neighbor_mode(find_arg(argc, argv, "neighbors"));
+    const int grain = std::stoi(find_arg(argc, argv, "grain", "0"));
+    // ranks sharing a node pin to disjoint cores
+    MPI_Comm node_comm;
+    int node_rank = 0;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_free(&node_comm);
+    // every rank's timestamps count from the same barrier
+    const std::string trace_file = find_arg(argc, argv, "trace");
+    if (!trace_file.empty()) {
+        tracer::name_thread("main");
+        MPI_Barrier(MPI_COMM_WORLD);
+        tracer::instance().start(find_arg(argc, argv, "trace_counters", "1") == "1");
+    }
+    thread_pool::configure(num_threads, find_arg(argc, argv, "pin_threads", "0") == "1", node_rank * num_threads);
+
+    const std::string force = find_arg(argc, argv, "force", "nearest");
+    output_config output;
+    output.file = find_arg(argc, argv, "output");
+    output.format = parse_output_format(find_arg(argc, argv, "format"));
+    if (!find_arg(argc, argv, "steps").empty()) {
+        simulation_config config;
+        config.steps = std::stoi(find_arg(argc, argv, "steps"));
+        config.dt = std::stod(find_arg(argc, argv, "dt", "1e-15"));
+        config.mass = std::stod(find_arg(argc, argv, "mass", "1.67e-27"));
+        config.skin = std::stod(find_arg(argc, argv, "skin", "0"));
+        config.checkpoint_every = std::stoi(find_arg(argc, argv, "checkpoint_every", "0"));
+        config.checkpoint_prefix = find_arg(argc, argv, "checkpoint_prefix", "checkpoint");
+        config.grain = grain;
+        return finish(simulation_main(rank, size, num_threads, num_particles, snapshot_file, config), trace_file, rank, size);
+    }
+    if (force == "allpairs" || force == "barneshut") {
+        int status = (force == "allpairs") ? all_pairs_main(rank, size, num_threads, num_particles, snapshot_file, output)
+            : barnes_hut_main(rank, size, num_threads, num_particles, snapshot_file, std::stod(find_arg(argc, argv, "theta", "0.5")),
+                              std::stoi(find_arg(argc, argv, "error_samples", "100")), output);
+        return finish(status, trace_file, rank, size);
+    }
+
+    if (!snapshot_file.empty()) {
+        double start_time = MPI_Wtime();
+        particle_snapshot snapshot;
+        trace_span read_span("map snapshot", "read");
+        if (!load_snapshot_everywhere(snapshot, snapshot_file, num_particles, rank)) {
+            return finish(-1, trace_file, rank, size);
+        }
+        read_span.end();
+        if (rank == 0) {
+            std::cout << "Time to read file: " << (MPI_Wtime() - start_time) * 1E6 << " microseconds." << std::endl;
+            start_time = MPI_Wtime();
+        }
+
+        std::vector<int> counts(size);
+        std::vector<int> displs(size);
+        int sum = 0;
+        for (int i = 0; i < size; i++) {
+            counts[i] = (i < num_particles % size) ? num_particles / size + 1 : num_particles / size;
+            displs[i] = sum;
+            sum += counts[i];
+        }
+
+        trace_span compute_span("nearest forces", "compute");
+        std::vector<double> local_result(counts[rank], -1);
+        compute_slice(snapshot.columns(), displs[rank], displs[rank] + counts[rank], grain, local_result);
+        compute_span.end();
+
+        finish_forces(output, local_result, counts, displs, num_particles, rank, size, start_time);
+        return finish(0, trace_file, rank, size);
+    }
+
+    const int chunk_lines = std::stoi(find_arg(argc, argv, "pipeline", "0"));
+    int status = (chunk_lines > 0) ? pipelined_nearest_main(rank, size, num_threads, num_particles, neighbors, chunk_lines, grain, output)
+        : nearest_main(rank, size, num_threads, num_particles, neighbors, find_arg(argc, argv, "read") == "parallel", grain, output);
+    return finish(status, trace_file, rank, size);
+}
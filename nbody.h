@@ -0,0 +1,271 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cmath>
+#include "common.h"
+#include "thread_pool.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NBODY_KERNEL_X86 1
+#endif
+
+// All-pairs net Coulomb force. Coordinates stay in file units (1e-10 m), so the
+// pairwise sums are scaled by kq1q2 * 1e20 once per particle at the end.
+constexpr double kNetForceScale = kq1q2 * 1e20;
+// 256 particles x (x, y, q) doubles = 6KB per block; two blocks plus their accumulators stay in L1/L2.
+constexpr int kNbodyBlockSize = 256;
+
+// Positions and charge signs as doubles, laid out for the tile kernels.
+struct nbody_particles {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> q;
+
+    nbody_particles() = default;
+
+    nbody_particles(const particle_columns& charges, size_t begin, size_t end)
+        : x(end - begin), y(end - begin), q(end - begin) {
+        for (size_t i = begin; i < end; i ++) {
+            x[i - begin] = charges.x[i];
+            y[i - begin] = charges.y[i];
+            q[i - begin] = charges.polarity ? charges.polarity[i] : 1;
+        }
+    }
+
+    size_t size() const { return x.size(); }
+};
+
+struct nbody_block {
+    const double* x;
+    const double* y;
+    const double* q;
+    int count;
+};
+
+inline nbody_block make_nbody_block(const double* x, const double* y, const double* q, int begin, int end) {
+    return nbody_block{x + begin, y + begin, q + begin, end - begin};
+}
+
+inline nbody_block make_nbody_block(const nbody_particles& p, int begin, int end) {
+    return make_nbody_block(p.x.data(), p.y.data(), p.q.data(), begin, end);
+}
+
+struct net_forces {
+    std::vector<double> fx;
+    std::vector<double> fy;
+
+    std::vector<double> magnitudes() const {
+        std::vector<double> ans(fx.size());
+        for (size_t i = 0; i < fx.size(); i ++) {
+            ans[i] = std::sqrt(fx[i] * fx[i] + fy[i] * fy[i]);
+        }
+        return ans;
+    }
+};
+
+// Accumulates the force of every particle in b on every particle in a into (ax, ay), in
+// unscaled units. When bx is non-null the opposite force goes into (bx, by) as well, so each
+// pair is evaluated once; with diagonal set a and b are the same block and only j > i is visited.
+// Coincident particles exert no force on each other.
+typedef void (*nbody_tile_kernel)(const nbody_block& a, const nbody_block& b, bool diagonal, double* ax, double* ay, double* bx, double* by);
+
+inline void nbody_pair(const nbody_block& a, int i, const nbody_block& b, int j, double& fx, double& fy, double* bx, double* by) {
+    double dx = a.x[i] - b.x[j];
+    double dy = a.y[i] - b.y[j];
+    double r2 = dx * dx + dy * dy;
+    if (r2 <= 0) return;
+    double inv_r = 1.0 / std::sqrt(r2);
+    double s = a.q[i] * b.q[j] * (inv_r * inv_r * inv_r);
+    fx += s * dx;
+    fy += s * dy;
+    if (bx) {
+        bx[j] -= s * dx;
+        by[j] -= s * dy;
+    }
+}
+
+inline void nbody_tile_scalar(const nbody_block& a, const nbody_block& b, bool diagonal, double* ax, double* ay, double* bx, double* by) {
+    for (int i = 0; i < a.count; i ++) {
+        double fx = 0, fy = 0;
+        for (int j = diagonal ? i + 1 : 0; j < b.count; j ++) {
+            nbody_pair(a, i, b, j, fx, fy, bx, by);
+        }
+        ax[i] += fx;
+        ay[i] += fy;
+    }
+}
+
+#ifdef NBODY_KERNEL_X86
+__attribute__((target("avx2")))
+inline void nbody_tile_avx2(const nbody_block& a, const nbody_block& b, bool diagonal, double* ax, double* ay, double* bx, double* by) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    for (int i = 0; i < a.count; i ++) {
+        const __m256d xi = _mm256_set1_pd(a.x[i]);
+        const __m256d yi = _mm256_set1_pd(a.y[i]);
+        const __m256d qi = _mm256_set1_pd(a.q[i]);
+        __m256d acc_x = zero;
+        __m256d acc_y = zero;
+        int j = diagonal ? i + 1 : 0;
+        for (; j + 4 <= b.count; j += 4) {
+            __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(b.x + j));
+            __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(b.y + j));
+            __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+            __m256d nonzero = _mm256_cmp_pd(r2, zero, _CMP_GT_OQ);
+            __m256d inv_r = _mm256_and_pd(_mm256_div_pd(one, _mm256_sqrt_pd(r2)), nonzero);
+            __m256d s = _mm256_mul_pd(_mm256_mul_pd(qi, _mm256_loadu_pd(b.q + j)), _mm256_mul_pd(inv_r, _mm256_mul_pd(inv_r, inv_r)));
+            __m256d sx = _mm256_mul_pd(s, dx);
+            __m256d sy = _mm256_mul_pd(s, dy);
+            acc_x = _mm256_add_pd(acc_x, sx);
+            acc_y = _mm256_add_pd(acc_y, sy);
+            if (bx) {
+                _mm256_storeu_pd(bx + j, _mm256_sub_pd(_mm256_loadu_pd(bx + j), sx));
+                _mm256_storeu_pd(by + j, _mm256_sub_pd(_mm256_loadu_pd(by + j), sy));
+            }
+        }
+        double lanes_x[4], lanes_y[4];
+        _mm256_storeu_pd(lanes_x, acc_x);
+        _mm256_storeu_pd(lanes_y, acc_y);
+        double fx = (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        double fy = (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+        for (; j < b.count; j ++) {
+            nbody_pair(a, i, b, j, fx, fy, bx, by);
+        }
+        ax[i] += fx;
+        ay[i] += fy;
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void nbody_tile_avx512(const nbody_block& a, const nbody_block& b, bool diagonal, double* ax, double* ay, double* bx, double* by) {
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d one = _mm512_set1_pd(1.0);
+    for (int i = 0; i < a.count; i ++) {
+        const __m512d xi = _mm512_set1_pd(a.x[i]);
+        const __m512d yi = _mm512_set1_pd(a.y[i]);
+        const __m512d qi = _mm512_set1_pd(a.q[i]);
+        __m512d acc_x = zero;
+        __m512d acc_y = zero;
+        int j = diagonal ? i + 1 : 0;
+        for (; j + 8 <= b.count; j += 8) {
+            __m512d dx = _mm512_sub_pd(xi, _mm512_loadu_pd(b.x + j));
+            __m512d dy = _mm512_sub_pd(yi, _mm512_loadu_pd(b.y + j));
+            __m512d r2 = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy));
+            __mmask8 nonzero = _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+            __m512d inv_r = _mm512_maskz_div_pd(nonzero, one, _mm512_sqrt_pd(r2));
+            __m512d s = _mm512_mul_pd(_mm512_mul_pd(qi, _mm512_loadu_pd(b.q + j)), _mm512_mul_pd(inv_r, _mm512_mul_pd(inv_r, inv_r)));
+            __m512d sx = _mm512_mul_pd(s, dx);
+            __m512d sy = _mm512_mul_pd(s, dy);
+            acc_x = _mm512_add_pd(acc_x, sx);
+            acc_y = _mm512_add_pd(acc_y, sy);
+            if (bx) {
+                _mm512_storeu_pd(bx + j, _mm512_sub_pd(_mm512_loadu_pd(bx + j), sx));
+                _mm512_storeu_pd(by + j, _mm512_sub_pd(_mm512_loadu_pd(by + j), sy));
+            }
+        }
+        double fx = _mm512_reduce_add_pd(acc_x);
+        double fy = _mm512_reduce_add_pd(acc_y);
+        for (; j < b.count; j ++) {
+            nbody_pair(a, i, b, j, fx, fy, bx, by);
+        }
+        ax[i] += fx;
+        ay[i] += fy;
+    }
+}
+#endif
+
+inline nbody_tile_kernel select_nbody_tile_kernel(const std::string& isa = "") {
+#ifdef NBODY_KERNEL_X86
+    __builtin_cpu_init();
+    if ((isa.empty() || isa == "avx512") && __builtin_cpu_supports("avx512f")) {
+        return nbody_tile_avx512;
+    }
+    if ((isa.empty() || isa == "avx512" || isa == "avx2") && __builtin_cpu_supports("avx2")) {
+        return nbody_tile_avx2;
+    }
+#endif
+    return nbody_tile_scalar;
+}
+
+inline nbody_tile_kernel default_nbody_tile_kernel() {
+    static const nbody_tile_kernel kernel = select_nbody_tile_kernel();
+    return kernel;
+}
+
+// Symmetric blocked all-pairs sum on one node, accumulated straight into the result. The block
+// pairs (I, J > I) are scheduled as a round-robin tournament: every block is in exactly one pair
+// per round, so the pairs of a round run side by side without sharing force entries. The diagonal
+// tiles (I, I) form one more round. Blocks shrink below kNbodyBlockSize for small n so a round
+// still has a pair for every thread.
+inline net_forces all_pairs_calculation(const particle_columns& charges, int num_threads=4, nbody_tile_kernel kernel=default_nbody_tile_kernel()) {
+    const int n = charges.count;
+    nbody_particles p(charges, 0, n);
+    num_threads = std::max(1, num_threads);
+
+    net_forces forces;
+    forces.fx.assign(n, 0.0);
+    forces.fy.assign(n, 0.0);
+    double* fx = forces.fx.data();
+    double* fy = forces.fy.data();
+    const int block_size = std::max(32, std::min(kNbodyBlockSize, n / (2 * num_threads)));
+    const int blocks = (n + block_size - 1) / block_size;
+    auto tile = [&](int bi, int bj) {
+        int a_begin = bi * block_size;
+        int b_begin = bj * block_size;
+        nbody_block a = make_nbody_block(p, a_begin, std::min(n, a_begin + block_size));
+        nbody_block b = make_nbody_block(p, b_begin, std::min(n, b_begin + block_size));
+        kernel(a, b, bi == bj, fx + a_begin, fy + a_begin, fx + b_begin, fy + b_begin);
+    };
+
+    thread_pool& pool = thread_pool::global();
+    pool.parallel_for(0, blocks, 1, [&](int start, int end) {
+        for (int bi = start; bi < end; bi ++) {
+            tile(bi, bi);
+        }
+    });
+    // circle method over an even number of slots: slot m - 1 stays put and meets block `round`,
+    // the others pair up around it; pairs with the padding slot (odd block counts) are skipped
+    const int m = blocks + (blocks & 1);
+    for (int round = 0; round + 1 < m; round ++) {
+        pool.parallel_for(0, m / 2, 1, [&](int start, int end) {
+            for (int k = start; k < end; k ++) {
+                int bi = (k == 0) ? m - 1 : (round + k) % (m - 1);
+                int bj = (round + m - 1 - k) % (m - 1);
+                if (bi < blocks && bj < blocks) {
+                    tile(std::min(bi, bj), std::max(bi, bj));
+                }
+            }
+        });
+    }
+
+    pool.parallel_for(0, n, 0, [&](int start, int end) {
+        for (int i = start; i < end; i ++) {
+            fx[i] *= kNetForceScale;
+            fy[i] *= kNetForceScale;
+        }
+    });
+    return forces;
+}
+
+// One-sided variant used when the source particles live elsewhere (e.g. a block passed around
+// an MPI ring): adds the force of every particle in sources onto targets[i] into (fx, fy).
+inline void accumulate_all_pairs(const nbody_block& targets, const nbody_block& sources, int num_threads, double* fx, double* fy, nbody_tile_kernel kernel=default_nbody_tile_kernel()) {
+    parallel_ranges(targets.count, num_threads, [&](int start, int end) {
+        for (int a_begin = start; a_begin < end; a_begin += kNbodyBlockSize) {
+            int a_end = std::min(end, a_begin + kNbodyBlockSize);
+            nbody_block a = {targets.x + a_begin, targets.y + a_begin, targets.q + a_begin, a_end - a_begin};
+            for (int b_begin = 0; b_begin < sources.count; b_begin += kNbodyBlockSize) {
+                nbody_block b = {sources.x + b_begin, sources.y + b_begin, sources.q + b_begin, std::min(sources.count - b_begin, kNbodyBlockSize)};
+                kernel(a, b, false, fx + a_begin, fy + a_begin, nullptr, nullptr);
+            }
+        }
+    });
+}
+
+inline const char* nbody_tile_kernel_name(nbody_tile_kernel kernel) {
+#ifdef NBODY_KERNEL_X86
+    if (kernel == nbody_tile_avx512) return "avx512";
+    if (kernel == nbody_tile_avx2) return "avx2";
+#endif
+    return "scalar";
+}
@@ -0,0 +1,192 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include "thread_pool.h"
+
+// Uniform bucket grid over 2D points for exact all-particles nearest-neighbor queries.
+// Cells are sized for ~2 points each, so a build is a parallel counting sort and a query only
+// scans rings of cells until no closer point can remain. Ties go to the lower index.
+// T is the coordinate type: int32_t for parsed particles, double for moving ones.
+template <typename T>
+class basic_spatial_grid {
+public:
+    typedef typename std::conditional<std::is_integral<T>::value, int64_t, double>::type distance_type;
+
+    void build(const T* x, const T* y, int count, int num_threads=1) {
+        if (count == 0) {
+            build(x, y, count, 0, 0, 0, 0, num_threads);
+            return;
+        }
+        build(x, y, count, *std::min_element(x, x + count), *std::min_element(y, y + count),
+              *std::max_element(x, x + count), *std::max_element(y, y + count), num_threads);
+    }
+
+    // Cells cover only [min_x, max_x] x [min_y, max_y]; points outside are kept in the border
+    // cells. Clamping never increases a cell distance, so queries stay exact, and a few far
+    // outliers cannot stretch the cells until everything else shares a handful of them.
+    void build(const T* x, const T* y, int count, T min_x, T min_y, T max_x, T max_y, int num_threads=1) {
+        x_ = x;
+        y_ = y;
+        count_ = count;
+        if (count == 0) {
+            return;
+        }
+
+        min_x_ = min_x;
+        min_y_ = min_y;
+        // integer extents count both end points
+        const distance_type pad = std::is_integral<T>::value ? 1 : 0;
+        distance_type width = static_cast<distance_type>(max_x) - min_x_ + pad;
+        distance_type height = static_cast<distance_type>(max_y) - min_y_ + pad;
+        // points sharing one x or y would leave a zero-width (floating point) extent
+        const distance_type min_extent = std::max<distance_type>(std::max(width, height), 1) / 1024;
+        width = std::max(width, min_extent);
+        height = std::max(height, min_extent);
+        double target_cells = std::max(1.0, count / 2.0);
+        double side = std::sqrt(static_cast<double>(width) * height / target_cells);
+        cell_size_ = std::is_integral<T>::value ? std::max<distance_type>(1, static_cast<distance_type>(std::ceil(side))) : static_cast<distance_type>(side);
+        // very elongated inputs would otherwise get far more cells than points
+        while (cells_along(width) * cells_along(height) > 2 * static_cast<int64_t>(count) + 16) {
+            cell_size_ *= 2;
+        }
+        cells_x_ = static_cast<int>(cells_along(width));
+        cells_y_ = static_cast<int>(cells_along(height));
+
+        std::vector<int> cell_of(count);
+        std::vector<std::atomic<int>> cursor(static_cast<size_t>(cells_x_) * cells_y_ + 1);
+        parallel_ranges(count, num_threads, [&](int start, int end) {
+            for (int i = start; i < end; i ++) {
+                cell_of[i] = cell_index(cell_coord(x[i], min_x_, cells_x_), cell_coord(y[i], min_y_, cells_y_));
+                cursor[cell_of[i] + 1].fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+
+        cell_start_.assign(cursor.size(), 0);
+        for (size_t c = 1; c < cursor.size(); c ++) {
+            cell_start_[c] = cell_start_[c - 1] + cursor[c].load(std::memory_order_relaxed);
+            cursor[c - 1].store(cell_start_[c - 1], std::memory_order_relaxed);
+        }
+
+        order_.resize(count);
+        parallel_ranges(count, num_threads, [&](int start, int end) {
+            for (int i = start; i < end; i ++) {
+                order_[cursor[cell_of[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+            }
+        });
+    }
+
+    // Index of the point closest to (px, py) other than exclude, or -1 if there is none.
+    // With skip_coincident, points sitting exactly on (px, py) are ignored as well.
+    int nearest(T px, T py, int exclude=-1, bool skip_coincident=false) const {
+        if (count_ == 0) {
+            return -1;
+        }
+        const int cx = cell_coord(px, min_x_, cells_x_);
+        const int cy = cell_coord(py, min_y_, cells_y_);
+        const int max_ring = std::max(std::max(cx, cells_x_ - 1 - cx), std::max(cy, cells_y_ - 1 - cy));
+
+        int best = -1;
+        distance_type best_d2 = std::numeric_limits<distance_type>::max();
+        for (int ring = 0; ring <= max_ring; ring ++) {
+            for_each_in_ring(cx, cy, ring, [&](int j) {
+                if (j == exclude) return;
+                const distance_type dx = static_cast<distance_type>(x_[j]) - px;
+                const distance_type dy = static_cast<distance_type>(y_[j]) - py;
+                const distance_type d2 = dx * dx + dy * dy;
+                if (skip_coincident && d2 == 0) return;
+                if (d2 < best_d2 || (d2 == best_d2 && j < best)) {
+                    best_d2 = d2;
+                    best = j;
+                }
+            });
+            // anything in ring + 1 is at least ring * cell_size away
+            const distance_type reach = ring * cell_size_;
+            if (best >= 0 && best_d2 <= reach * reach) {
+                break;
+            }
+        }
+        return best;
+    }
+
+    // Calls fn(j, d2) for every point within radius of (px, py).
+    template <typename Fn>
+    void for_each_within(T px, T py, distance_type radius, Fn fn) const {
+        if (count_ == 0) {
+            return;
+        }
+        const int cx = cell_coord(px, min_x_, cells_x_);
+        const int cy = cell_coord(py, min_y_, cells_y_);
+        const int max_ring = std::min<int64_t>(std::max(std::max(cx, cells_x_ - 1 - cx), std::max(cy, cells_y_ - 1 - cy)),
+                                              static_cast<int64_t>(radius / cell_size_) + 1);
+        for (int ring = 0; ring <= max_ring; ring ++) {
+            for_each_in_ring(cx, cy, ring, [&](int j) {
+                const distance_type dx = static_cast<distance_type>(x_[j]) - px;
+                const distance_type dy = static_cast<distance_type>(y_[j]) - py;
+                const distance_type d2 = dx * dx + dy * dy;
+                if (d2 <= radius * radius) fn(j, d2);
+            });
+        }
+    }
+
+    // out[i] = nearest other point to point i, queried in parallel.
+    void nearest_all(int32_t* out, int num_threads=1) const {
+        parallel_ranges(count_, num_threads, [&](int start, int end) {
+            for (int i = start; i < end; i ++) {
+                out[i] = nearest(x_[i], y_[i], i);
+            }
+        });
+    }
+
+private:
+    template <typename Fn>
+    void for_each_in_ring(int cx, int cy, int ring, Fn fn) const {
+        for (int gy = cy - ring; gy <= cy + ring; gy ++) {
+            if (gy < 0 || gy >= cells_y_) continue;
+            const bool edge_row = (gy == cy - ring || gy == cy + ring);
+            const int step = edge_row ? 1 : std::max(2 * ring, 1);
+            for (int gx = cx - ring; gx <= cx + ring; gx += step) {
+                if (gx < 0 || gx >= cells_x_) continue;
+                const int c = cell_index(gx, gy);
+                for (int k = cell_start_[c]; k < cell_start_[c + 1]; k ++) {
+                    fn(order_[k]);
+                }
+            }
+        }
+    }
+
+    int64_t cells_along(distance_type extent) const {
+        return static_cast<int64_t>(std::ceil(static_cast<double>(extent) / cell_size_));
+    }
+
+    // Cell column/row of v, clamped to [0, cells) so points outside the covered box land in border cells.
+    int cell_coord(T v, T origin, int cells) const {
+        const double c = std::floor((static_cast<double>(v) - origin) / cell_size_);
+        // also catches NaN
+        if (!(c > 0)) return 0;
+        return c < cells - 1 ? static_cast<int>(c) : cells - 1;
+    }
+
+    int cell_index(int gx, int gy) const {
+        return gy * cells_x_ + gx;
+    }
+
+    const T* x_ = nullptr;
+    const T* y_ = nullptr;
+    int count_ = 0;
+    T min_x_ = 0;
+    T min_y_ = 0;
+    distance_type cell_size_ = 1;
+    int cells_x_ = 1;
+    int cells_y_ = 1;
+    std::vector<int> cell_start_;
+    std::vector<int> order_;
+};
+
+typedef basic_spatial_grid<int32_t> spatial_grid;
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "common.h"
+
+// Owning structure-of-arrays copy of the particles; hot loops work on columns().
+struct particle_store {
+    std::vector<int32_t> x;
+    std::vector<int32_t> y;
+    std::vector<int32_t> nearest_neighbor_idx;
+    std::vector<int8_t> polarity;
+
+    particle_store() = default;
+
+    explicit particle_store(const std::vector<point_charge>& charges)
+        : x(charges.size()), y(charges.size()), nearest_neighbor_idx(charges.size()), polarity(charges.size()) {
+        for (size_t i = 0; i < charges.size(); i ++) {
+            x[i] = charges[i].x;
+            y[i] = charges[i].y;
+            nearest_neighbor_idx[i] = charges[i].nearest_neighbor_idx;
+            polarity[i] = static_cast<int8_t>(charges[i].polarity);
+        }
+    }
+
+    size_t size() const { return x.size(); }
+
+    particle_columns columns() const {
+        particle_columns c;
+        c.count = x.size();
+        c.x = x.data();
+        c.y = y.data();
+        c.polarity = polarity.data();
+        c.nearest_neighbor_idx = nearest_neighbor_idx.data();
+        return c;
+    }
+};
@@ -0,0 +1,297 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "common.h"
+#include "thread_pool.h"
+#include "neighbor_search.h"
+
+// Time stepping under the nearest-neighbor Coulomb force. Positions keep the input's units of
+// 1e-10 m, velocities are in those units per second. Every particle feels only its current
+// nearest neighbor (ignoring any sitting exactly on top of it), pushing apart for like charges.
+constexpr double kUnitLength = 1e-10;
+
+// Moving particles, structure-of-arrays. The first owned() entries are integrated; in the MPI
+// build the rest are read-only halo copies of particles owned by other ranks.
+struct particle_state {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> vx;
+    std::vector<double> vy;
+    std::vector<double> ax;
+    std::vector<double> ay;
+    std::vector<int8_t> polarity;
+    // index in the input, kept through migration so checkpoints can be merged
+    std::vector<int32_t> id;
+
+    size_t size() const { return x.size(); }
+
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        vx.resize(n);
+        vy.resize(n);
+        ax.resize(n);
+        ay.resize(n);
+        polarity.resize(n);
+        id.resize(n);
+    }
+};
+
+// Particles at rest.
+inline particle_state make_particle_state(const particle_columns& columns) {
+    particle_state state;
+    state.resize(columns.count);
+    for (size_t i = 0; i < columns.count; i ++) {
+        state.x[i] = columns.x[i];
+        state.y[i] = columns.y[i];
+        state.polarity[i] = columns.polarity[i];
+        state.id[i] = i;
+    }
+    return state;
+}
+
+// Roughly 0.3 of the mean particle spacing, which keeps candidate lists at a few entries.
+inline double default_skin(const particle_state& state, int owned) {
+    if (owned < 2) {
+        return 1.0;
+    }
+    const auto x_range = std::minmax_element(state.x.begin(), state.x.begin() + owned);
+    const auto y_range = std::minmax_element(state.y.begin(), state.y.begin() + owned);
+    const double area = std::max(1.0, (*x_range.second - *x_range.first) * (*y_range.second - *y_range.first));
+    return 0.3 * std::sqrt(area / owned);
+}
+
+// Verlet candidate lists: at build time particle i keeps every particle within d_nn(i) + skin.
+// While no particle has moved more than skin / 4 since, whichever particle is now nearest must
+// still be on that list, so the exact nearest neighbor is a scan over a handful of candidates.
+class verlet_neighbors {
+public:
+    // Lists are built for particles [0, owned) and may point at any of [0, count).
+    void build(const particle_state& state, int owned, double skin, int num_threads) {
+        const int count = state.size();
+        skin_ = skin;
+        owned_ = owned;
+        reach_ = 0;
+        // the bulk of the particles sizes the cells; runaway ones are clamped into the border cells
+        double min_x, max_x, min_y, max_y;
+        central_range(state.x, count, min_x, max_x);
+        central_range(state.y, count, min_y, max_y);
+        grid_.build(state.x.data(), state.y.data(), count, min_x, min_y, max_x, max_y, num_threads);
+        x0_.assign(state.x.begin(), state.x.begin() + owned);
+        y0_.assign(state.y.begin(), state.y.begin() + owned);
+
+        std::vector<double> radius(owned);
+        start_.assign(owned + 1, 0);
+        parallel_ranges(owned, num_threads, [&](int begin, int end) {
+            for (int i = begin; i < end; i ++) {
+                const int nearest = grid_.nearest(state.x[i], state.y[i], i, true);
+                // an isolated particle has nothing to find; an infinite reach makes callers widen the halo
+                radius[i] = nearest < 0 ? HUGE_VAL : std::sqrt(squared_distance(state, i, nearest)) + skin;
+                if (nearest < 0) continue;
+                int found = 0;
+                grid_.for_each_within(state.x[i], state.y[i], radius[i], [&](int j, double) { found += (j != i); });
+                start_[i + 1] = found;
+            }
+        });
+        for (int i = 0; i < owned; i ++) {
+            start_[i + 1] += start_[i];
+            reach_ = std::max(reach_, radius[i]);
+        }
+
+        candidates_.resize(start_[owned]);
+        parallel_ranges(owned, num_threads, [&](int begin, int end) {
+            for (int i = begin; i < end; i ++) {
+                if (start_[i + 1] == start_[i]) continue;
+                int k = start_[i];
+                grid_.for_each_within(state.x[i], state.y[i], radius[i], [&](int j, double) {
+                    if (j != i) candidates_[k ++] = j;
+                });
+            }
+        });
+    }
+
+    // Largest distance any owned particle has moved since the last build.
+    double max_displacement(const particle_state& state, int num_threads) const {
+        std::vector<double> partial(std::max(num_threads, 1), 0.0);
+        const int chunk = (owned_ + partial.size() - 1) / partial.size();
+        parallel_ranges(partial.size(), num_threads, [&](int first, int last) {
+            for (int t = first; t < last; t ++) {
+                for (int i = t * chunk; i < std::min(owned_, (t + 1) * chunk); i ++) {
+                    const double dx = state.x[i] - x0_[i];
+                    const double dy = state.y[i] - y0_[i];
+                    partial[t] = std::max(partial[t], dx * dx + dy * dy);
+                }
+            }
+        });
+        return std::sqrt(*std::max_element(partial.begin(), partial.end()));
+    }
+
+    bool stale(double displacement) const {
+        return displacement > skin_ / 4;
+    }
+
+    // Current nearest neighbor of owned particle i, or -1. Ties go to the lower id, so every
+    // domain decomposition picks the same neighbor.
+    int nearest(const particle_state& state, int i) const {
+        int best = -1;
+        double best_d2 = HUGE_VAL;
+        for (int k = start_[i]; k < start_[i + 1]; k ++) {
+            const int j = candidates_[k];
+            const double d2 = squared_distance(state, i, j);
+            if (d2 > 0 && (d2 < best_d2 || (d2 == best_d2 && state.id[j] < state.id[best]))) {
+                best_d2 = d2;
+                best = j;
+            }
+        }
+        return best;
+    }
+
+    // Largest d_nn + skin at build time: the halo width the lists needed.
+    double reach() const { return reach_; }
+
+    double skin() const { return skin_; }
+
+    size_t candidate_count() const { return candidates_.size(); }
+
+private:
+    // Range of v[0, count) without its outer 0.5% on either side.
+    static void central_range(const std::vector<double>& v, int count, double& lo, double& hi) {
+        if (count == 0) {
+            lo = hi = 0;
+            return;
+        }
+        std::vector<double> sorted(v.begin(), v.begin() + count);
+        const int trim = count / 200;
+        std::nth_element(sorted.begin(), sorted.begin() + trim, sorted.end());
+        lo = sorted[trim];
+        std::nth_element(sorted.begin(), sorted.end() - 1 - trim, sorted.end());
+        hi = sorted[count - 1 - trim];
+    }
+
+    static double squared_distance(const particle_state& state, int i, int j) {
+        const double dx = state.x[i] - state.x[j];
+        const double dy = state.y[i] - state.y[j];
+        return dx * dx + dy * dy;
+    }
+
+    basic_spatial_grid<double> grid_;
+    double skin_ = 0;
+    double reach_ = 0;
+    int owned_ = 0;
+    std::vector<double> x0_;
+    std::vector<double> y0_;
+    std::vector<int> start_;
+    std::vector<int> candidates_;
+};
+
+// a = F / mass from the current nearest neighbor, converted to units per second squared.
+inline void nearest_accelerations(particle_state& state, int owned, const verlet_neighbors& neighbors, double mass, int grain) {
+    // F = kq1q2 * p_i * p_j * r / |r|^3 with r in meters; a further 1 / kUnitLength gives units per second squared
+    const double scale = kq1q2 / (kUnitLength * kUnitLength * kUnitLength) / mass;
+    thread_pool::global().parallel_for(0, owned, grain, [&](int start, int end) {
+        for (int i = start; i < end; i ++) {
+            const int j = neighbors.nearest(state, i);
+            if (j < 0) {
+                state.ax[i] = state.ay[i] = 0;
+                continue;
+            }
+            const double dx = state.x[i] - state.x[j];
+            const double dy = state.y[i] - state.y[j];
+            const double r2 = dx * dx + dy * dy;
+            const double f = scale * state.polarity[i] * state.polarity[j] / (r2 * std::sqrt(r2));
+            state.ax[i] = f * dx;
+            state.ay[i] = f * dy;
+        }
+    });
+}
+
+// Velocity Verlet split as kick (half step) - drift - forces - kick (half step).
+inline void half_kick(particle_state& state, int owned, double dt, int grain) {
+    thread_pool::global().parallel_for(0, owned, grain, [&](int start, int end) {
+        for (int i = start; i < end; i ++) {
+            state.vx[i] += 0.5 * dt * state.ax[i];
+            state.vy[i] += 0.5 * dt * state.ay[i];
+        }
+    });
+}
+
+inline void drift(particle_state& state, int owned, double dt, int grain) {
+    thread_pool::global().parallel_for(0, owned, grain, [&](int start, int end) {
+        for (int i = start; i < end; i ++) {
+            state.x[i] += dt * state.vx[i];
+            state.y[i] += dt * state.vy[i];
+        }
+    });
+}
+
+// Writes "id,x,y,vx,vy,polarity" rows for the owned particles, returns false if the file could not be opened.
+inline bool write_checkpoint(const std::string& filename, const particle_state& state, int owned) {
+    FILE* out = std::fopen(filename.c_str(), "w");
+    if (!out) {
+        std::cerr << "could not write checkpoint " << filename << std::endl;
+        return false;
+    }
+    for (int i = 0; i < owned; i ++) {
+        std::fprintf(out, "%d,%.17g,%.17g,%.17g,%.17g,%c\n", state.id[i], state.x[i], state.y[i], state.vx[i], state.vy[i],
+                     state.polarity[i] < 0 ? '-' : '+');
+    }
+    std::fclose(out);
+    return true;
+}
+
+struct simulation_config {
+    int steps = 10;
+    double dt = 1e-15;
+    double mass = 1.67e-27;
+    // 0 picks default_skin
+    double skin = 0;
+    int checkpoint_every = 0;
+    std::string checkpoint_prefix = "checkpoint";
+    int grain = 0;
+};
+
+struct simulation_stats {
+    int steps = 0;
+    int rebuilds = 0;
+    double seconds = 0;
+};
+
+inline std::string checkpoint_name(const std::string& prefix, int step, int rank=-1) {
+    return prefix + (rank >= 0 ? "_rank" + std::to_string(rank) : "") + "_step" + std::to_string(step) + ".csv";
+}
+
+// Advances every particle of state by config.steps steps on the global pool.
+inline simulation_stats run_simulation(particle_state& state, const simulation_config& config, int num_threads) {
+    simulation_stats stats;
+    const int n = state.size();
+    const double skin = config.skin > 0 ? config.skin : default_skin(state, n);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    verlet_neighbors neighbors;
+    neighbors.build(state, n, skin, num_threads);
+    nearest_accelerations(state, n, neighbors, config.mass, config.grain);
+    for (int step = 1; step <= config.steps; step ++) {
+        half_kick(state, n, config.dt, config.grain);
+        drift(state, n, config.dt, config.grain);
+        if (neighbors.stale(neighbors.max_displacement(state, num_threads))) {
+            trace_span span("rebuild neighbor lists", "partition");
+            neighbors.build(state, n, skin, num_threads);
+            stats.rebuilds ++;
+        }
+        nearest_accelerations(state, n, neighbors, config.mass, config.grain);
+        half_kick(state, n, config.dt, config.grain);
+        stats.steps = step;
+        if (config.checkpoint_every > 0 && step % config.checkpoint_every == 0) {
+            write_checkpoint(checkpoint_name(config.checkpoint_prefix, step), state, n);
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    stats.seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() * 1E-6;
+    return stats;
+}
@@ -0,0 +1,160 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+
+// On-disk particle snapshot: a fixed header followed by 64-byte aligned SoA columns
+//   int32 x[count], int32 y[count], int32 nearest_neighbor_idx[count], int8 polarity[count]
+// The file is mapped read-only and the columns are used in place.
+constexpr char kSnapshotMagic[8] = {'P', 'C', 'H', 'G', 'S', 'N', 'A', 'P'};
+constexpr uint32_t kSnapshotVersion = 1;
+constexpr uint64_t kSnapshotAlignment = 64;
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t count;
+    int32_t min_x;
+    int32_t min_y;
+    int32_t max_x;
+    int32_t max_y;
+    uint64_t x_offset;
+    uint64_t y_offset;
+    uint64_t nearest_neighbor_offset;
+    uint64_t polarity_offset;
+};
+
+inline uint64_t snapshot_align(uint64_t offset) {
+    return (offset + kSnapshotAlignment - 1) / kSnapshotAlignment * kSnapshotAlignment;
+}
+
+inline snapshot_header make_snapshot_header(uint64_t count) {
+    snapshot_header header = {};
+    memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.header_size = sizeof(snapshot_header);
+    header.count = count;
+    header.x_offset = snapshot_align(sizeof(snapshot_header));
+    header.y_offset = snapshot_align(header.x_offset + count * sizeof(int32_t));
+    header.nearest_neighbor_offset = snapshot_align(header.y_offset + count * sizeof(int32_t));
+    header.polarity_offset = snapshot_align(header.nearest_neighbor_offset + count * sizeof(int32_t));
+    return header;
+}
+
+inline bool write_snapshot(const std::string& filename, const std::vector<point_charge>& charges) {
+    snapshot_header header = make_snapshot_header(charges.size());
+    header.min_x = header.min_y = INT_MAX;
+    header.max_x = header.max_y = INT_MIN;
+    for (const auto & charge : charges) {
+        header.min_x = std::min(header.min_x, charge.x);
+        header.min_y = std::min(header.min_y, charge.y);
+        header.max_x = std::max(header.max_x, charge.x);
+        header.max_y = std::max(header.max_y, charge.y);
+    }
+
+    const uint64_t file_size = header.polarity_offset + charges.size() * sizeof(int8_t);
+    std::vector<char> buffer(file_size, 0);
+    memcpy(buffer.data(), &header, sizeof(header));
+    int32_t* x = reinterpret_cast<int32_t*>(buffer.data() + header.x_offset);
+    int32_t* y = reinterpret_cast<int32_t*>(buffer.data() + header.y_offset);
+    int32_t* nearest = reinterpret_cast<int32_t*>(buffer.data() + header.nearest_neighbor_offset);
+    int8_t* polarity = reinterpret_cast<int8_t*>(buffer.data() + header.polarity_offset);
+    for (size_t i = 0; i < charges.size(); i ++) {
+        x[i] = charges[i].x;
+        y[i] = charges[i].y;
+        nearest[i] = charges[i].nearest_neighbor_idx;
+        polarity[i] = static_cast<int8_t>(charges[i].polarity);
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "could not open " << filename << " for writing" << std::endl;
+        return false;
+    }
+    file.write(buffer.data(), buffer.size());
+    return static_cast<bool>(file);
+}
+
+// Owns the read-only mapping of a snapshot file; columns() points straight into it.
+class particle_snapshot {
+public:
+    particle_snapshot() = default;
+    particle_snapshot(const particle_snapshot&) = delete;
+    particle_snapshot& operator=(const particle_snapshot&) = delete;
+    ~particle_snapshot() { unmap(); }
+
+    bool load(const std::string& filename) {
+        unmap();
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "could not open snapshot " << filename << std::endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(snapshot_header))) {
+            std::cerr << "snapshot " << filename << " is truncated" << std::endl;
+            close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "could not map snapshot " << filename << std::endl;
+            return false;
+        }
+        data_ = static_cast<const char*>(mapped);
+        size_ = st.st_size;
+
+        memcpy(&header_, data_, sizeof(header_));
+        if (memcmp(header_.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 || header_.version != kSnapshotVersion
+                || header_.header_size != sizeof(snapshot_header)) {
+            std::cerr << "snapshot " << filename << " has an unsupported format" << std::endl;
+            unmap();
+            return false;
+        }
+        snapshot_header expected = make_snapshot_header(header_.count);
+        if (header_.x_offset != expected.x_offset || header_.y_offset != expected.y_offset
+                || header_.nearest_neighbor_offset != expected.nearest_neighbor_offset
+                || header_.polarity_offset != expected.polarity_offset
+                || header_.polarity_offset + header_.count > size_) {
+            std::cerr << "snapshot " << filename << " is truncated" << std::endl;
+            unmap();
+            return false;
+        }
+
+        columns_.count = header_.count;
+        columns_.x = reinterpret_cast<const int32_t*>(data_ + header_.x_offset);
+        columns_.y = reinterpret_cast<const int32_t*>(data_ + header_.y_offset);
+        columns_.nearest_neighbor_idx = reinterpret_cast<const int32_t*>(data_ + header_.nearest_neighbor_offset);
+        columns_.polarity = reinterpret_cast<const int8_t*>(data_ + header_.polarity_offset);
+        return true;
+    }
+
+    const snapshot_header& header() const { return header_; }
+    const particle_columns& columns() const { return columns_; }
+    size_t size() const { return columns_.count; }
+
+private:
+    void unmap() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        columns_ = particle_columns();
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    snapshot_header header_ = {};
+    particle_columns columns_;
+};
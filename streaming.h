@@ -0,0 +1,310 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
+#include "particle_store.h"
+#include "force_kernel.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "force_output.h"
+
+// Out-of-core nearest-neighbor forces: the input is read through a fixed buffer one window of
+// whole lines at a time and the forces are written out as each window finishes, so memory stays
+// the same whatever the file size. Neighbors are the adjacent ones in file order; a window
+// keeps the last two lines of the one before, so every line sees both of its neighbors.
+
+// Reads "x,y,polarity" lines through a buffer of window_bytes with pread.
+class window_reader {
+public:
+    window_reader() = default;
+    window_reader(const window_reader&) = delete;
+    window_reader& operator=(const window_reader&) = delete;
+
+    ~window_reader() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool open(const std::string& filename, size_t window_bytes) {
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            return false;
+        }
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+        buffer_.resize(std::max<size_t>(window_bytes, 4096));
+        rewind();
+        return true;
+    }
+
+    void rewind() {
+        offset_ = 0;
+        begin_ = end_ = 0;
+        eof_ = false;
+    }
+
+    // Replaces charges with the next window, at most max_lines lines; false once the file is done.
+    bool next(std::vector<point_charge>& charges, int max_lines, int num_threads) {
+        charges.clear();
+        if (max_lines <= 0) {
+            return false;
+        }
+        // keep the partial line at the end of the last window and top the buffer up
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+        while (!eof_ && end_ < buffer_.size()) {
+            ssize_t got = pread(fd_, buffer_.data() + end_, buffer_.size() - end_, offset_);
+            if (got < 0) {
+                std::cerr << "could not read input: " << std::strerror(errno) << std::endl;
+            }
+            if (got <= 0) {
+                eof_ = true;
+                break;
+            }
+            end_ += got;
+            offset_ += got;
+        }
+
+        const char* data = buffer_.data();
+        const char* stop = data + end_;
+        if (!eof_) {
+            const char* eol = static_cast<const char*>(memrchr(data, '\n', end_));
+            if (!eol) {
+                std::cerr << "a line is longer than the " << buffer_.size() << " byte window" << std::endl;
+                return false;
+            }
+            stop = eol + 1;
+        }
+        if (stop == data) {
+            return false;
+        }
+        parse_point_charges(data, stop, max_lines, num_threads, charges);
+        begin_ = stop - data;
+        return !charges.empty();
+    }
+
+private:
+    int fd_ = -1;
+    off_t offset_ = 0;
+    std::vector<char> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+};
+
+// Writes buffers to a file on a background thread. The caller fills buffer() while the previous
+// buffer is being written and hands it over with submit(), so only two buffers ever exist. A
+// buffer is a list of blocks, as format_forces_parallel leaves them, written with writev.
+class async_writer {
+public:
+    async_writer() = default;
+    async_writer(const async_writer&) = delete;
+    async_writer& operator=(const async_writer&) = delete;
+
+    ~async_writer() {
+        close();
+    }
+
+    bool open(const std::string& filename) {
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            std::cerr << "could not write " << filename << std::endl;
+            return false;
+        }
+        writer_ = std::thread([this] { write_loop(); });
+        return true;
+    }
+
+    std::vector<std::vector<char>>& buffer() {
+        return buffers_[filling_];
+    }
+
+    // Queues buffer() for writing once the previous buffer is out; buffer() is then the other one.
+    void submit() {
+        trace_span span("wait for writer", "queue wait");
+        std::unique_lock<std::mutex> lk(mtx_);
+        cv_.wait(lk, [this] { return writing_ < 0; });
+        writing_ = filling_;
+        filling_ = 1 - filling_;
+        cv_.notify_all();
+    }
+
+    // Waits for the last write and closes the file; false if any write failed.
+    bool close() {
+        if (fd_ < 0) {
+            return ok_;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        writer_.join();
+        ok_ = (::close(fd_) == 0) && ok_;
+        fd_ = -1;
+        return ok_;
+    }
+
+private:
+    void write_loop() {
+        std::unique_lock<std::mutex> lk(mtx_);
+        while (true) {
+            cv_.wait(lk, [this] { return writing_ >= 0 || stop_; });
+            if (writing_ < 0) {
+                return;
+            }
+            std::vector<std::vector<char>>& blocks = buffers_[writing_];
+            lk.unlock();
+            {
+                trace_span span("write output", "gather");
+                ok_ = write_blocks(fd_, blocks) && ok_;
+            }
+            for (auto & block : blocks) {
+                block.clear();
+            }
+            lk.lock();
+            writing_ = -1;
+            cv_.notify_all();
+        }
+    }
+
+    int fd_ = -1;
+    std::thread writer_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<std::vector<char>> buffers_[2];
+    int filling_ = 0;
+    int writing_ = -1;
+    bool stop_ = false;
+    bool ok_ = true;
+};
+
+struct stream_config {
+    size_t window_bytes = 1 << 24;
+    std::string output;
+    output_format format = output_format::text;
+    int grain = 0;
+};
+
+struct stream_stats {
+    int64_t particles = 0;
+    int64_t windows = 0;
+    int passes = 0;
+};
+
+// Streams the forces of num_particles particles from filename to config.output (nowhere if it is
+// empty). Like setup_point_charges, only the first num_particles lines are used and a shorter
+// file is tiled, so the output matches the in-memory modes. Returns false if the file cannot be
+// used; stats then holds what was done.
+inline bool stream_nearest_forces(const std::string& filename, int64_t num_particles, const stream_config& config, int num_threads,
+                                  nearest_force_kernel kernel, stream_stats& stats) {
+    window_reader reader;
+    if (!reader.open(filename, config.window_bytes)) {
+        return false;
+    }
+    async_writer writer;
+    if (!config.output.empty() && !writer.open(config.output)) {
+        return false;
+    }
+
+    // work holds the carried lines followed by the window; forces come out for all but the last line
+    std::vector<point_charge> window;
+    std::vector<point_charge> work;
+    particle_store store;
+    std::vector<double> forces;
+    int64_t lines = num_particles;
+
+    auto emit = [&](int from, int to) {
+        const int count = std::min<int64_t>(to - from, num_particles - stats.particles);
+        if (count <= 0) {
+            return;
+        }
+        trace_span span("window forces", "compute");
+        const particle_columns columns = store.columns();
+        forces.resize(count);
+        thread_pool::global().parallel_for(from, from + count, config.grain, [&](int start, int stop) {
+            kernel(columns, start, stop, forces.data() + (start - from));
+        });
+        if (!config.output.empty()) {
+            format_forces_parallel(forces.data(), count, stats.particles, config.format, writer.buffer());
+            writer.submit();
+        }
+        stats.particles += count;
+    };
+
+    auto fill_store = [&]() {
+        store.x.resize(work.size());
+        store.y.resize(work.size());
+        store.polarity.resize(work.size());
+        store.nearest_neighbor_idx.resize(work.size());
+        for (size_t k = 0; k < work.size(); k ++) {
+            store.x[k] = work[k].x;
+            store.y[k] = work[k].y;
+            store.polarity[k] = static_cast<int8_t>(work[k].polarity);
+            store.nearest_neighbor_idx[k] = work[k].nearest_neighbor_idx;
+        }
+    };
+
+    while (stats.particles < num_particles) {
+        // a pass reads up to `lines` lines; after the first pass that is the length of the file
+        stats.passes ++;
+        reader.rewind();
+        work.clear();
+        int64_t read = 0;
+        // line number of work[0], and the index in work of the first line whose force is still owed
+        int64_t work_start = 0;
+        int pending = 0;
+        while (true) {
+            trace_span read_span("read window", "read");
+            if (!reader.next(window, std::min<int64_t>(lines - read, 1 << 30), num_threads)) {
+                break;
+            }
+            read_span.end();
+            read += window.size();
+            stats.windows ++;
+            work.insert(work.end(), window.begin(), window.end());
+            for (int k = pending; k + 1 < work.size(); k ++) {
+                if (k == 0 && work_start == 0) {
+                    work[k].nearest_neighbor_idx = 1;
+                    continue;
+                }
+                double prev_distance = distance_between_square(work[k], work[k - 1]);
+                double next_distance = distance_between_square(work[k], work[k + 1]);
+                work[k].nearest_neighbor_idx = (prev_distance < next_distance) ? k - 1 : k + 1;
+            }
+            fill_store();
+            emit(pending, work.size() - 1);
+            if (stats.particles >= num_particles) {
+                break;
+            }
+            // carry the last line, still owed, and the one before it
+            const size_t dropped = work.size() - std::min<size_t>(2, work.size());
+            work.erase(work.begin(), work.begin() + dropped);
+            work_start += dropped;
+            pending = work.size() - 1;
+        }
+        if (stats.particles >= num_particles) {
+            break;
+        }
+        if (read < 2) {
+            std::cerr << "too few points!" << std::endl;
+            return false;
+        }
+        // the last line of the file (or of the first num_particles lines) pairs with the one before
+        work.back().nearest_neighbor_idx = work.size() - 2;
+        fill_store();
+        emit(work.size() - 1, work.size());
+        lines = read;
+    }
+    return config.output.empty() || writer.close();
+}
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <sstream>
+// main.cpp brings its own main(); gtest_main provides the test runner's
+#define main force_main
 #include "main.cpp"
+#undef main
 
 TEST(SetupPointChargesTest, TestFileNotFound) {
     std::vector<point_charge> charges = setup_point_charges("nonexistent-file.csv");
@@ -18,7 +21,7 @@ TEST(SetupPointChargesTest, TestFileContent) {
     std::ifstream file("particles-student-1.csv");
     std::string line;
     int line_count = 0;
-    while (getline(file, line)) {
+    while (getline(file, line) && line_count < charges.size()) {
         std::stringstream ss(line);
         point_charge charge;
         char comma, polarity;
@@ -27,4 +30,276 @@ TEST(SetupPointChargesTest, TestFileContent) {
         EXPECT_EQ(charges[line_count].y, charge.y);
         line_count++;
     }
-}
\ No newline at end of file
+}
+TEST(SetupPointChargesTest, TestByteRangesCoverFile) {
+    // ten copies of the input, so each third is several MB and is parsed by two threads
+    {
+        std::ifstream in("particles-student-1.csv");
+        std::stringstream content;
+        content << in.rdbuf();
+        std::ofstream out("test-byte-ranges.csv");
+        for (int copy = 0; copy < 10; copy ++) {
+            out << content.str();
+        }
+    }
+    std::vector<point_charge> whole = read_point_charges("test-byte-ranges.csv", INT_MAX);
+    struct stat st;
+    ASSERT_EQ(stat("test-byte-ranges.csv", &st), 0);
+    ASSERT_GT(st.st_size / 3, 2 << 20);
+    std::vector<point_charge> pieces;
+    for (int r = 0; r < 3; r ++) {
+        std::vector<point_charge> piece = read_point_charges("test-byte-ranges.csv", INT_MAX, 2, st.st_size * r / 3, st.st_size * (r + 1) / 3);
+        pieces.insert(pieces.end(), piece.begin(), piece.end());
+    }
+    std::remove("test-byte-ranges.csv");
+    ASSERT_EQ(pieces.size(), whole.size());
+    for (int i = 0; i < whole.size(); i ++) {
+        EXPECT_EQ(pieces[i].x, whole[i].x);
+        EXPECT_EQ(pieces[i].y, whole[i].y);
+        EXPECT_EQ(pieces[i].polarity, whole[i].polarity);
+    }
+}
+
+TEST(SnapshotTest, TestRoundTrip) {
+    std::vector<point_charge> charges = setup_point_charges("particles-student-1.csv", 2000);
+    ASSERT_TRUE(write_snapshot("test-snapshot.snap", charges));
+    particle_snapshot snapshot;
+    ASSERT_TRUE(snapshot.load("test-snapshot.snap"));
+    const particle_columns& columns = snapshot.columns();
+    ASSERT_EQ(columns.count, charges.size());
+    for (int i = 0; i < charges.size(); i ++) {
+        EXPECT_EQ(columns.x[i], charges[i].x);
+        EXPECT_EQ(columns.y[i], charges[i].y);
+        EXPECT_EQ(columns.polarity[i], charges[i].polarity);
+        EXPECT_EQ(columns.nearest_neighbor_idx[i], charges[i].nearest_neighbor_idx);
+    }
+    std::remove("test-snapshot.snap");
+}
+
+TEST(ForceKernelTest, TestVectorKernelsMatchScalar) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 1003));
+    std::vector<double> expected = serial_calculation(store.columns(), nearest_force_scalar);
+    for (const char* isa : {"avx2", "avx512"}) {
+        std::vector<double> actual = serial_calculation(store.columns(), select_nearest_force_kernel(isa));
+        for (int i = 0; i < expected.size(); i ++) {
+            EXPECT_EQ(actual[i], expected[i]);
+        }
+    }
+}
+
+TEST(ForceKernelTest, TestLawsMatchDirectFormulas) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 1003));
+    particle_columns c = store.columns();
+    // the same particles with double coordinates go through the scalar kernel unchanged
+    std::vector<double> x(store.x.begin(), store.x.end()), y(store.y.begin(), store.y.end());
+    basic_particle_columns<double> d;
+    d.count = c.count;
+    d.x = x.data();
+    d.y = y.data();
+    d.nearest_neighbor_idx = c.nearest_neighbor_idx;
+    std::vector<double> from_doubles(c.count);
+    nearest_force_scalar<double, lennard_jones_law>(d, 0, d.count, from_doubles.data());
+    for (force_law law : {force_law::coulomb, force_law::softened_coulomb, force_law::lennard_jones}) {
+        for (const char* isa : {"scalar", "avx2", "avx512"}) {
+            std::vector<double> forces = serial_calculation(c, select_nearest_force_kernel(isa, law));
+            for (int i = 0; i < c.count; i ++) {
+                double r2 = distance_between_square(c, i, c.nearest_neighbor_idx[i]) * 1e-20;
+                double expected = kq1q2 / r2;
+                if (law == force_law::softened_coulomb) {
+                    expected = kq1q2 / (r2 + 1e-20);
+                } else if (law == force_law::lennard_jones) {
+                    double s6 = std::pow(3.4e-10 * 3.4e-10 / r2, 3);
+                    expected = 24 * 1.65e-21 / std::sqrt(r2) * (2 * s6 * s6 - s6);
+                    EXPECT_EQ(forces[i], from_doubles[i]);
+                }
+                EXPECT_NEAR(forces[i], expected, 1e-12 * std::abs(expected));
+            }
+        }
+    }
+}
+
+TEST(ForceKernelTest, TestFloatKernelsMatchDoubleReference) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 1003));
+    for (force_law law : {force_law::coulomb, force_law::softened_coulomb}) {
+        std::vector<double> exact = serial_calculation(store.columns(), select_nearest_force_kernel("scalar", law));
+        for (const char* isa : {"scalar", "avx2", "avx512"}) {
+            std::vector<float> forces = multithread_calculation(store.columns(), 3, select_nearest_force_kernel<float>(isa, law));
+            approximation_error error = single_precision_error(store.columns(), forces, select_nearest_force_kernel("scalar", law), 1003);
+            EXPECT_EQ(error.samples, exact.size());
+            EXPECT_LT(error.max_relative, 1e-6);
+        }
+    }
+}
+
+TEST(NeighborSearchTest, TestGridMatchesBruteForce) {
+    std::vector<point_charge> charges = setup_point_charges("particles-student-1.csv", 3000, 4, neighbor_mode::grid);
+    for (int i = 0; i < charges.size(); i ++) {
+        double best = INFINITY;
+        int best_idx = -1;
+        for (int j = 0; j < charges.size(); j ++) {
+            double d = distance_between_square(charges[i], charges[j]);
+            if (j != i && d < best) {
+                best = d;
+                best_idx = j;
+            }
+        }
+        EXPECT_EQ(charges[i].nearest_neighbor_idx, best_idx);
+    }
+}
+
+TEST(AllPairsTest, TestMatchesDirectSum) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 700));
+    particle_columns c = store.columns();
+    net_forces forces = all_pairs_calculation(c, 3);
+    for (int i = 0; i < c.count; i ++) {
+        double fx = 0, fy = 0;
+        for (int j = 0; j < c.count; j ++) {
+            double dx = (c.x[i] - c.x[j]) * 1e-10, dy = (c.y[i] - c.y[j]) * 1e-10;
+            double r = std::sqrt(dx * dx + dy * dy);
+            if (r == 0) continue;
+            fx += kq1q2 * c.polarity[i] * c.polarity[j] * dx / (r * r * r);
+            fy += kq1q2 * c.polarity[i] * c.polarity[j] * dy / (r * r * r);
+        }
+        double scale = std::hypot(fx, fy);
+        EXPECT_NEAR(forces.fx[i], fx, 1e-9 * scale);
+        EXPECT_NEAR(forces.fy[i], fy, 1e-9 * scale);
+    }
+}
+
+TEST(BarnesHutTest, TestConvergesToAllPairs) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 5000));
+    net_forces exact = all_pairs_calculation(store.columns(), 2);
+    approximation_error loose = sample_force_error(store.columns(), barnes_hut_calculation(store.columns(), 0.8, 2), 200, 2);
+    approximation_error tight = sample_force_error(store.columns(), barnes_hut_calculation(store.columns(), 0.1, 2), 200, 2);
+    EXPECT_LT(sample_force_error(store.columns(), exact, 200, 2).max_relative, 1e-10);
+    EXPECT_LT(tight.rms_relative, loose.rms_relative);
+    EXPECT_LT(tight.rms_relative, 1e-3);
+}
+
+TEST(ThreadPoolTest, TestRepeatedParallelFor) {
+    thread_pool pool(4);
+    std::vector<int> hits(10007, 0);
+    for (int round = 0; round < 200; round ++) {
+        pool.parallel_for(0, hits.size(), 37, [&](int start, int end) {
+            for (int i = start; i < end; i ++) hits[i] ++;
+        });
+    }
+    for (int h : hits) {
+        EXPECT_EQ(h, 200);
+    }
+}
+
+TEST(ThreadPoolTest, TestPinnedWorkersStayInAffinityMask) {
+    cpu_set_t allowed;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+    std::vector<int> cpus(64, -1);
+    {
+        // more workers than most masks hold, so the mapping has to wrap around inside the mask
+        thread_pool pool(2 * CPU_COUNT(&allowed) + 1, true);
+        pool.parallel_for(0, cpus.size(), 1, [&](int start, int end) {
+            for (int i = start; i < end; i ++) cpus[i] = sched_getcpu();
+        });
+    }
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu : cpus) {
+        EXPECT_TRUE(cpu >= 0 && CPU_ISSET(cpu, &allowed)) << "ran on CPU " << cpu;
+    }
+}
+
+TEST(SimulationTest, TestVerletListTracksNearestNeighbor) {
+    particle_store store(setup_point_charges("particles-student-1.csv", 3000, 4));
+    particle_state state = make_particle_state(store.columns());
+    const int n = state.size();
+    const double skin = default_skin(state, n);
+    verlet_neighbors neighbors;
+    neighbors.build(state, n, skin, 4);
+
+    // any move within skin / 4 must keep the lists exact
+    srand(7);
+    for (int i = 0; i < n; i ++) {
+        double angle = rand() * 2 * M_PI / RAND_MAX;
+        double length = 0.99 * skin / 4 * rand() / RAND_MAX;
+        state.x[i] += length * std::cos(angle);
+        state.y[i] += length * std::sin(angle);
+    }
+    EXPECT_FALSE(neighbors.stale(neighbors.max_displacement(state, 4)));
+    for (int i = 0; i < n; i ++) {
+        double best = INFINITY;
+        int best_idx = -1;
+        for (int j = 0; j < n; j ++) {
+            double dx = state.x[i] - state.x[j];
+            double dy = state.y[i] - state.y[j];
+            double d = dx * dx + dy * dy;
+            if (j != i && d > 0 && d < best) {
+                best = d;
+                best_idx = j;
+            }
+        }
+        EXPECT_EQ(neighbors.nearest(state, i), best_idx);
+    }
+}
+
+TEST(TraceTest, TestSpansOnlyRecordedWhileEnabled) {
+    { trace_span span("before start", "test"); }
+    tracer::instance().start(false);
+    thread_pool::configure(4);
+    std::vector<double> hits(10000);
+    thread_pool::global().parallel_for(0, hits.size(), 100, [&](int start, int end) {
+        trace_span span("test chunk", "test");
+        for (int i = start; i < end; i ++) hits[i] += 1;
+    });
+    tracer::instance().stop();
+    { trace_span span("after stop", "test"); }
+
+    std::string json = tracer::instance().events_json(0, "test");
+    EXPECT_EQ(json.find("before start"), std::string::npos);
+    EXPECT_EQ(json.find("after stop"), std::string::npos);
+    int chunks = 0;
+    for (size_t at = json.find("\"test chunk\""); at != std::string::npos; at = json.find("\"test chunk\"", at + 1)) {
+        chunks ++;
+    }
+    EXPECT_EQ(chunks, 100);
+}
+
+TEST(StreamingTest, TestSmallWindowsMatchInMemoryForces) {
+    // 4 KB windows put several window boundaries into the first 2500 lines
+    const int n = 2500;
+    std::vector<double> expected = serial_calculation(particle_store(setup_point_charges("particles-student-1.csv", n)).columns());
+    stream_config config;
+    config.window_bytes = 4096;
+    config.output = "streaming_test.bin";
+    config.format = output_format::binary;
+    stream_stats stats;
+    ASSERT_TRUE(stream_nearest_forces("particles-student-1.csv", n, config, 4, default_nearest_force_kernel(), stats));
+    EXPECT_EQ(stats.particles, n);
+    EXPECT_GT(stats.windows, 1);
+
+    std::vector<double> streamed(n);
+    FILE* in = fopen(config.output.c_str(), "rb");
+    ASSERT_NE(in, nullptr);
+    EXPECT_EQ(fread(streamed.data(), sizeof(double), n, in), n);
+    fclose(in);
+    remove(config.output.c_str());
+    EXPECT_EQ(streamed, expected);
+}
+
+TEST(OutputTest, TestTextMatchesListingAndCsvRoundTrips) {
+    std::vector<double> forces = {4.60288e-09, 2.3014412345678e-08, 1e-05, 123456789.0, 6.02e23, 0.1};
+    std::ostringstream listing;
+    for (int i = 0; i < forces.size(); i ++) {
+        listing << "ID: " << i + 1 << ", Force=" << forces[i] << "\n";
+    }
+    std::vector<char> text;
+    format_forces(forces.data(), forces.size(), 0, output_format::text, text);
+    EXPECT_EQ(std::string(text.begin(), text.end()), listing.str());
+
+    ASSERT_TRUE(write_forces("output_test.csv", forces, output_format::csv));
+    std::ifstream file("output_test.csv");
+    std::string line;
+    for (int i = 0; i < forces.size(); i ++) {
+        ASSERT_TRUE(std::getline(file, line));
+        EXPECT_EQ(std::stoi(line.substr(0, line.find(','))), i + 1);
+        EXPECT_EQ(std::stod(line.substr(line.find(',') + 1)), forces[i]);
+    }
+    remove("output_test.csv");
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include "trace.h"
+
+// Persistent pool with one deque per worker. parallel_for cuts a range into grain-sized chunks,
+// deals them round-robin onto the deques and wakes the workers; each worker drains its own deque
+// from the back and then steals from the front of the others. The calling thread acts as worker 0,
+// so a pool of size n runs n - 1 background threads. Calls from inside a running chunk execute
+// inline, and only one thread at a time should drive a given pool. While tracing, every chunk is
+// a span on the thread that ran it and the caller's wait for the last chunk is a queue wait span.
+class thread_pool {
+public:
+    // With pin_threads, worker i (the caller being 0) is bound to the (first_core + i)-th CPU the
+    // process may run on (its sched_getaffinity mask, e.g. from taskset or mpirun --bind-to),
+    // wrapping around when there are more workers than CPUs.
+    explicit thread_pool(int num_threads, bool pin_threads=false, int first_core=0) : slots_(std::max(1, num_threads)) {
+        if (pin_threads) {
+            pin_to_core(first_core);
+        }
+        for (int id = 1; id < slots_.size(); id ++) {
+            workers_.emplace_back([this, id, pin_threads, first_core] {
+                tracer::name_thread("pool worker " + std::to_string(id));
+                if (pin_threads) {
+                    pin_to_core(first_core + id);
+                }
+                worker_loop(id);
+            });
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lk(wake_mtx_);
+            stop_ = true;
+        }
+        wake_cv_.notify_all();
+        for (auto & worker : workers_) {
+            worker.join();
+        }
+    }
+
+    int size() const { return slots_.size(); }
+
+    // Runs fn(start, stop) over [begin, end) in chunks of at most grain (0 picks ~8 chunks per thread).
+    template <typename Fn>
+    void parallel_for(int begin, int end, int grain, Fn&& fn) {
+        if (end <= begin) {
+            return;
+        }
+        if (grain <= 0) {
+            grain = std::max(1, (end - begin + 8 * size() - 1) / (8 * size()));
+        }
+        if (inside_pool() || size() == 1 || end - begin <= grain) {
+            for (int start = begin; start < end; start += grain) {
+                fn(start, std::min(end, start + grain));
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> call_lock(call_mtx_);
+        typedef typename std::remove_reference<Fn>::type fn_type;
+        invoke_ = [](void* context, int start, int stop) { (*static_cast<fn_type*>(context))(start, stop); };
+        context_ = static_cast<void*>(&fn);
+        const int chunks = (end - begin + grain - 1) / grain;
+        remaining_.store(chunks);
+        for (int c = 0; c < chunks; c ++) {
+            int start = begin + c * grain;
+            slot& s = slots_[c % slots_.size()];
+            std::lock_guard<std::mutex> lk(s.mtx);
+            s.tasks.push_back(chunk{start, std::min(end, start + grain)});
+        }
+        {
+            std::lock_guard<std::mutex> lk(wake_mtx_);
+            generation_ ++;
+        }
+        wake_cv_.notify_all();
+
+        inside_pool() = true;
+        while (run_one(0)) {}
+        inside_pool() = false;
+        trace_span span("wait for workers", "queue wait");
+        std::unique_lock<std::mutex> lk(wake_mtx_);
+        done_cv_.wait(lk, [this] { return remaining_.load() == 0; });
+    }
+
+    // Process-wide pool shared by both binaries; configure() before first use to size it.
+    static thread_pool& global() {
+        std::lock_guard<std::mutex> lk(global_mtx());
+        if (!global_pool()) {
+            global_pool().reset(new thread_pool(std::max(1u, std::thread::hardware_concurrency())));
+        }
+        return *global_pool();
+    }
+
+    static void configure(int num_threads, bool pin_threads=false, int first_core=0) {
+        std::lock_guard<std::mutex> lk(global_mtx());
+        global_pool().reset();
+        global_pool().reset(new thread_pool(num_threads, pin_threads, first_core));
+    }
+
+private:
+    struct chunk {
+        int begin;
+        int end;
+    };
+
+    struct slot {
+        std::mutex mtx;
+        std::deque<chunk> tasks;
+    };
+
+    static bool& inside_pool() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    static std::mutex& global_mtx() {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    static std::unique_ptr<thread_pool>& global_pool() {
+        static std::unique_ptr<thread_pool> pool;
+        return pool;
+    }
+
+    // The CPUs in the process's affinity mask, read once before any pool thread is pinned.
+    static const std::vector<int>& allowed_cpus() {
+        static const std::vector<int> cpus = [] {
+            std::vector<int> allowed;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+                    if (CPU_ISSET(cpu, &set)) {
+                        allowed.push_back(cpu);
+                    }
+                }
+            }
+            return allowed;
+        }();
+        return cpus;
+    }
+
+    static void pin_to_core(int index) {
+        const std::vector<int>& cpus = allowed_cpus();
+        if (cpus.empty()) {
+            std::cerr << "could not read the CPU affinity mask, thread not pinned" << std::endl;
+            return;
+        }
+        const int cpu = cpus[index % cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error != 0) {
+            std::cerr << "could not pin thread to CPU " << cpu << ": " << std::strerror(error) << std::endl;
+        }
+    }
+
+    bool pop(int id, chunk& c) {
+        {
+            slot& own = slots_[id];
+            std::lock_guard<std::mutex> lk(own.mtx);
+            if (!own.tasks.empty()) {
+                c = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (int k = 1; k < slots_.size(); k ++) {
+            slot& victim = slots_[(id + k) % slots_.size()];
+            std::lock_guard<std::mutex> lk(victim.mtx);
+            if (!victim.tasks.empty()) {
+                c = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool run_one(int id) {
+        chunk c;
+        if (!pop(id, c)) {
+            return false;
+        }
+        {
+            trace_span span("chunk", "compute");
+            invoke_(context_, c.begin, c.end);
+        }
+        if (remaining_.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lk(wake_mtx_);
+            done_cv_.notify_all();
+        }
+        return true;
+    }
+
+    void worker_loop(int id) {
+        inside_pool() = true;
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(wake_mtx_);
+                wake_cv_.wait(lk, [&] { return stop_ || generation_ != seen; });
+                if (stop_) {
+                    return;
+                }
+                seen = generation_;
+            }
+            while (run_one(id)) {}
+        }
+    }
+
+    std::vector<slot> slots_;
+    std::vector<std::thread> workers_;
+    std::mutex call_mtx_;
+    std::mutex wake_mtx_;
+    std::condition_variable wake_cv_;
+    std::condition_variable done_cv_;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+    std::atomic<int> remaining_{0};
+    void (*invoke_)(void*, int, int) = nullptr;
+    void* context_ = nullptr;
+};
+
+// Runs fn(begin, end) over [0, count) split into num_threads contiguous ranges on the global pool.
+template <typename Fn>
+void parallel_ranges(int count, int num_threads, Fn fn) {
+    num_threads = std::max(1, std::min(num_threads, count));
+    if (num_threads == 1) {
+        fn(0, count);
+        return;
+    }
+    thread_pool::global().parallel_for(0, count, (count + num_threads - 1) / num_threads, fn);
+}
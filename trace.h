@@ -0,0 +1,261 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Runtime-switchable tracing. Until tracer::instance().start() is called a trace_span costs one
+// relaxed atomic load. Once started, every thread appends complete events to its own log: no
+// locks on the hot path. Each event records the CPU it started on and, when perf_event_open is
+// allowed, the user-space cycles and cache misses of the thread over the span. The logs are
+// written as Chrome trace JSON, which chrome://tracing and ui.perfetto.dev open directly.
+class tracer {
+public:
+    struct event {
+        const char* name;
+        const char* category;
+        int64_t start_ns;
+        int64_t duration_ns;
+        int cpu;
+        // -1 without hardware counters
+        int64_t cycles;
+        int64_t cache_misses;
+    };
+
+    static tracer& instance() {
+        static tracer t;
+        return t;
+    }
+
+    static bool enabled() {
+        return enabled_flag().load(std::memory_order_relaxed);
+    }
+
+    // Timestamps count from here; MPI ranks call it right after a barrier so their clocks line up.
+    void start(bool counters=true) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        epoch_ = std::chrono::steady_clock::now();
+        counters_ = counters;
+        for (auto & log : logs_) {
+            log->events.clear();
+        }
+        enabled_flag().store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+        enabled_flag().store(false, std::memory_order_relaxed);
+    }
+
+    int64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    // Names the calling thread in the trace, e.g. "pool worker 3". Cheap while tracing is off: the
+    // name is only kept until the thread records its first event.
+    static void name_thread(const std::string& name) {
+        thread_name() = name;
+        if (log_pointer()) {
+            log_pointer()->name = name;
+        }
+    }
+
+    void record(const event& e) {
+        local().events.push_back(e);
+    }
+
+    // Reads the calling thread's counters into cycles and cache_misses, or sets both to -1.
+    void read_counters(int64_t& cycles, int64_t& cache_misses) {
+        thread_log& log = local();
+        cycles = cache_misses = -1;
+#ifdef __linux__
+        if (log.perf_fd >= 0) {
+            struct {
+                uint64_t nr;
+                uint64_t values[2];
+            } group;
+            if (::read(log.perf_fd, &group, sizeof(group)) == sizeof(group)) {
+                cycles = group.values[0];
+                cache_misses = group.values[1];
+            }
+        }
+#endif
+    }
+
+    // Comma-separated trace events of every thread so far, process pid named process_name.
+    // Call it once the traced work has finished.
+    std::string events_json(int pid, const std::string& process_name) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        std::string json;
+        char buffer[512];
+        std::snprintf(buffer, sizeof(buffer), "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, process_name.c_str());
+        json += buffer;
+        for (int tid = 0; tid < logs_.size(); tid ++) {
+            const thread_log& log = *logs_[tid];
+            if (log.events.empty()) {
+                continue;
+            }
+            std::snprintf(buffer, sizeof(buffer), ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                          pid, tid, log.name.c_str());
+            json += buffer;
+            for (const event& e : log.events) {
+                int length = std::snprintf(buffer, sizeof(buffer), ",\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cpu\":%d",
+                                           e.name, e.category, pid, tid, e.start_ns * 1E-3, e.duration_ns * 1E-3, e.cpu);
+                if (e.cycles >= 0) {
+                    length += std::snprintf(buffer + length, sizeof(buffer) - length, ",\"cycles\":%lld,\"cache_misses\":%lld",
+                                            static_cast<long long>(e.cycles), static_cast<long long>(e.cache_misses));
+                }
+                std::snprintf(buffer + length, sizeof(buffer) - length, "}}");
+                json += buffer;
+            }
+        }
+        return json;
+    }
+
+    // Wraps events_json output (several processes' joined with ",\n") into a trace file.
+    static bool write(const std::string& filename, const std::string& events) {
+        FILE* out = std::fopen(filename.c_str(), "w");
+        if (!out) {
+            std::cerr << "could not write trace " << filename << std::endl;
+            return false;
+        }
+        std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n%s\n]}\n", events.c_str());
+        std::fclose(out);
+        return true;
+    }
+
+private:
+    struct thread_log {
+        std::string name;
+        std::vector<event> events;
+        int perf_fd = -1;
+        int perf_member_fd = -1;
+
+        ~thread_log() {
+#ifdef __linux__
+            if (perf_member_fd >= 0) close(perf_member_fd);
+            if (perf_fd >= 0) close(perf_fd);
+#endif
+        }
+    };
+
+    static std::atomic<bool>& enabled_flag() {
+        static std::atomic<bool> flag{false};
+        return flag;
+    }
+
+    static std::string& thread_name() {
+        static thread_local std::string name;
+        return name;
+    }
+
+    static thread_log*& log_pointer() {
+        static thread_local thread_log* log = nullptr;
+        return log;
+    }
+
+    // Logs outlive their threads (the pool is rebuilt by configure()), so they are only freed at exit.
+    thread_log& local() {
+        thread_log*& log = log_pointer();
+        if (!log) {
+            std::lock_guard<std::mutex> lk(mtx_);
+            logs_.emplace_back(new thread_log);
+            log = logs_.back().get();
+            log->name = thread_name().empty() ? "thread " + std::to_string(logs_.size() - 1) : thread_name();
+            if (counters_) {
+                open_counters(*log);
+            }
+        }
+        return *log;
+    }
+
+    // Cycles and cache misses of this thread in user space, as one group so they are read together.
+    static void open_counters(thread_log& log) {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        log.perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (log.perf_fd < 0) {
+            return;
+        }
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 0;
+        log.perf_member_fd = syscall(__NR_perf_event_open, &attr, 0, -1, log.perf_fd, 0);
+        if (log.perf_member_fd < 0) {
+            close(log.perf_fd);
+            log.perf_fd = -1;
+            return;
+        }
+        ioctl(log.perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<thread_log>> logs_;
+    std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+    bool counters_ = true;
+};
+
+// Records [construction, end() or destruction) as one event on the calling thread while tracing
+// is on. name and category must be string literals (or otherwise outlive the trace).
+class trace_span {
+public:
+    trace_span(const char* name, const char* category) {
+        if (!tracer::enabled()) {
+            return;
+        }
+        active_ = true;
+        e_.name = name;
+        e_.category = category;
+        e_.cpu = sched_getcpu();
+        tracer::instance().read_counters(e_.cycles, e_.cache_misses);
+        e_.start_ns = tracer::instance().now_ns();
+    }
+
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    ~trace_span() {
+        end();
+    }
+
+    // Ends the span early; later calls do nothing.
+    void end() {
+        if (!active_) {
+            return;
+        }
+        active_ = false;
+        tracer& t = tracer::instance();
+        e_.duration_ns = t.now_ns() - e_.start_ns;
+        if (e_.cycles >= 0) {
+            int64_t cycles, cache_misses;
+            t.read_counters(cycles, cache_misses);
+            e_.cycles = cycles - e_.cycles;
+            e_.cache_misses = cache_misses - e_.cache_misses;
+        }
+        t.record(e_);
+    }
+
+private:
+    bool active_ = false;
+    tracer::event e_;
+};